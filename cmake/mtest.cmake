@@ -10,6 +10,61 @@ if (NOT MTEST_RUNNER)
     message(FATAL_ERROR "MTEST_RUNNER is not set, must point to test executable!")
 endif()
 
+# Adds coverage instrumentation for --mtest-fuzz to a library under test.
+# MTEST_SANCOV only instruments the runner's own sources, so call this for
+# every target linked into the runner whose code fuzz tests should explore.
+function(mtest_sancov target)
+    if (CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+        target_compile_options(${target} PRIVATE -fsanitize-coverage=trace-pc-guard)
+    else()
+        target_compile_options(${target} PRIVATE -fsanitize-coverage=trace-pc)
+    endif()
+endfunction()
+
+# Optional build settings for the test runner target
+if (TARGET ${MTEST_RUNNER})
+    # Use the low-footprint header (forward declarations only)
+    if (MTEST_LIGHT)
+        target_compile_definitions(${MTEST_RUNNER} PRIVATE MTEST_LIGHT)
+    endif()
+
+    # Precompile mtest.h, MTEST_HEADER must point to it
+    if (MTEST_PCH)
+        if (CMAKE_VERSION VERSION_LESS 3.16)
+            message(FATAL_ERROR "MTEST_PCH requires CMake 3.16 or newer (found ${CMAKE_VERSION})!")
+        endif()
+
+        if (NOT MTEST_HEADER)
+            message(FATAL_ERROR "MTEST_PCH requires MTEST_HEADER to point to mtest.h!")
+        endif()
+
+        target_precompile_headers(${MTEST_RUNNER} PRIVATE ${MTEST_HEADER})
+    endif()
+
+    # Coverage feedback for --mtest-fuzz, Clang and GCC only
+    if (MTEST_SANCOV)
+        if (CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+            set(MTEST_SANCOV_FLAG "-fsanitize-coverage=trace-pc-guard")
+        else()
+            set(MTEST_SANCOV_FLAG "-fsanitize-coverage=trace-pc")
+        endif()
+
+        # Instrument the code under test only, mtest.cpp holds the coverage
+        # callbacks and must not call back into itself
+        get_target_property(runnersources ${MTEST_RUNNER} SOURCES)
+
+        foreach(runnersource ${runnersources})
+            get_filename_component(runnername "${runnersource}" NAME)
+
+            if (NOT runnername STREQUAL "mtest.cpp")
+                set_property(SOURCE ${runnersource} APPEND_STRING PROPERTY COMPILE_FLAGS " ${MTEST_SANCOV_FLAG}")
+            endif()
+        endforeach()
+
+        target_compile_definitions(${MTEST_RUNNER} PRIVATE MTEST_SANCOV)
+    endif()
+endif()
+
 foreach(source ${MTEST_SOURCES})
     string(REGEX REPLACE ".*CMakeFiles.*" "" testsource "${source}")
 
@@ -19,11 +74,12 @@ foreach(source ${MTEST_SOURCES})
 endforeach()
 
 foreach(testsource ${testsources})
-    file(STRINGS ${testsource} testlines REGEX "^[ \n\t\r]*TEST[ \n\t\r]*\\([^\\)]+\\).*")
+    file(STRINGS ${testsource} testlines REGEX "^[ \n\t\r]*(FUZZ_)?TEST(_ASYNC)?[ \n\t\r]*\\([^\\)]+\\).*")
 
     foreach (testline ${testlines})
         string (REGEX REPLACE "\\).*" "" testname "${testline}")
         string (REGEX REPLACE ".*\\(" "" testname "${testname}")
+        string (REGEX REPLACE "[ \t]*,.*" "" testname "${testname}")
         message("> Discovered test : ${testname}")
         add_test(NAME "${testname}" COMMAND ${MTEST_RUNNER} "${testname}")
     endforeach()
@@ -0,0 +1,63 @@
+#define MTEST_MAIN
+#include "../../mtest.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Use TEST_ASYNC(MyTestName) to define tests which wait on timers or file
+// descriptors. While a test is suspended in co_await, the event loop runs
+// other tests, so these all finish in about one second.
+
+TEST_ASYNC(SleepTest1) {
+  co_await mtest_sleep(1000);
+  EXPECT(1);
+}
+
+TEST_ASYNC(SleepTest2) {
+  co_await mtest_sleep(1000);
+  EXPECT(1);
+}
+
+TEST_ASYNC(SleepTest3) {
+  for (int i = 0; i < 10; ++i)
+    co_await mtest_sleep(100);
+}
+
+TEST_ASYNC(SocketTest) {
+  int fds[2];
+  char c = 0;
+
+  EXPECT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  co_await mtest_writable(fds[0]);
+  EXPECT_EQ(write(fds[0], "x", 1), 1);
+
+  co_await mtest_readable(fds[1]);
+  EXPECT_EQ(read(fds[1], &c, 1), 1);
+  EXPECT_EQ(c, 'x');
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Closes both ends of a pipe when it goes out of scope
+struct Pipe {
+  Pipe() { if (pipe(fds)) fds[0] = fds[1] = -1; }
+  ~Pipe() { close(fds[0]); close(fds[1]); }
+
+  int fds[2];
+};
+
+// A test waiting on a descriptor which never becomes ready fails once
+// --mtest-timeout passes (60 seconds by default, 2 in this example's
+// makefile) instead of hanging the run. Its locals are destroyed, so the
+// pipe is closed.
+TEST_ASYNC(TimeoutTest) {
+  Pipe p;
+
+  co_await mtest_readable(p.fds[0]); // nothing is ever written
+  EXPECT(0); // unreachable
+}
+
+// Synchronous tests still run on the worker threads
+TEST(SyncTest) { EXPECT(1); }
@@ -0,0 +1,98 @@
+#include "../../mtest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// The buffer assertions scan whole blocks with SSE2 or AVX2 and finish the
+// tail with a scalar loop. These tests check that the kernels agree with a
+// plain comparison at every alignment and tail length. Buffers shorter than
+// an AVX2 block go to the SSE2 kernel, so both run on AVX2 machines.
+
+static size_t reference_mismatches(const unsigned char *a, const unsigned char *b,
+                                   size_t count, size_t elem, size_t *first) {
+  size_t mismatches = 0;
+
+  *first = count;
+  for (size_t i = 0; i < count; ++i)
+    if (memcmp(a + i * elem, b + i * elem, elem) && !mismatches++)
+      *first = i;
+
+  return mismatches;
+}
+
+TEST(MemKernelTest) {
+  std::mt19937 rng(1234);
+  std::vector<unsigned char> a(320), b(320);
+  const size_t elems[] = { 1, 2, 4, 8 };
+
+  for (size_t elem : elems)
+    for (size_t offset = 0; offset < 32; ++offset)
+      for (size_t len = 0; len + offset <= 256; len += elem) {
+        size_t count = len / elem;
+
+        for (size_t i = 0; i < a.size(); ++i)
+          a[i] = b[i] = (unsigned char)rng();
+
+        // Up to three differing bytes, always including the last one
+        if (count) {
+          b[offset + len - 1] ^= 0x80;
+          b[offset + rng() % len] ^= 1;
+          b[offset + rng() % len] ^= 0x10;
+        }
+
+        size_t first, expected_first;
+        size_t mismatches = _mtest_mem_mismatches(&a[offset], &b[offset], count,
+                                                  elem, &first);
+        size_t expected = reference_mismatches(&a[offset], &b[offset], count,
+                                               elem, &expected_first);
+
+        ASSERT_EQ(mismatches, expected);
+        ASSERT_EQ(first, expected_first);
+      }
+}
+
+TEST(NearAllTest) {
+  std::vector<float> fa(100), fb(100);
+  std::vector<double> da(100), db(100);
+
+  for (size_t i = 0; i < fa.size(); ++i) {
+    fa[i] = da[i] = i * 0.25;
+    fb[i] = fa[i] + 0.0005f;
+    db[i] = da[i] - 0.0005;
+  }
+
+  // Within the tolerance at every offset and tail length
+  for (size_t offset = 0; offset < 8; ++offset)
+    for (size_t count = 0; offset + count <= fa.size(); ++count) {
+      EXPECT_NEAR_ALL(&fa[offset], &fb[offset], count, 0.001);
+      EXPECT_NEAR_ALL(&da[offset], &db[offset], count, 0.001);
+    }
+}
+
+// Fails only when run by check.cmake, which checks the reported counts
+TEST(BufferFailureTest) {
+  if (!getenv("BASIC_CHECK_FAILURES"))
+    return;
+
+  std::vector<unsigned char> a(128, 7), b(128, 7);
+  std::vector<float> fa(64, 1.0f), fb(64, 1.0f);
+  std::vector<double> da(64, 1.0), db(64, 1.0);
+  std::vector<short> sa(45, 3), sb(45, 3);
+
+  // Unaligned buffers with differences in the vector blocks and the tail
+  b[5] = b[40] = b[102] = 0;
+  EXPECT_MEM_EQ(&a[3], &b[3], 100);
+
+  fb[4] = 2.0f;
+  fb[37] = 1.5f;
+  EXPECT_NEAR_ALL(&fa[1], &fb[1], 37, 0.1);
+
+  db[2] = 0.0 / 0.0;
+  db[60] = 1.25;
+  EXPECT_NEAR_ALL(&da[1], &db[1], 63, 0.1);
+
+  sb[44] = 4;
+  EXPECT_RANGE_EQ(sa, sb);
+}
@@ -0,0 +1,275 @@
+# Invoked by `make check` and by the BasicChecks test in examples/cmake.
+# Runs the basic example with different options in an empty working
+# directory and checks each feature from the output and the files written.
+#
+# Usage: cmake -DRUNNER=<basic> -DWORK_DIR=<dir> -P check.cmake
+
+cmake_minimum_required(VERSION 3.19)
+
+if (NOT RUNNER OR NOT WORK_DIR)
+    message(FATAL_ERROR "usage: cmake -DRUNNER=<basic> -DWORK_DIR=<dir> -P check.cmake")
+endif()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# Runs the example in WORK_DIR, storing its output in `out`
+function(run_basic out)
+    execute_process(
+        COMMAND ${RUNNER} ${ARGN}
+        WORKING_DIRECTORY ${WORK_DIR}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output)
+    set(${out} "${output}" PARENT_SCOPE)
+endfunction()
+
+function(expect_match check output regex)
+    if (NOT output MATCHES "${regex}")
+        message(FATAL_ERROR "${check}: expected output matching \"${regex}\", got:\n${output}")
+    endif()
+endfunction()
+
+function(expect_no_match check output regex)
+    if (output MATCHES "${regex}")
+        message(FATAL_ERROR "${check}: unexpected output matching \"${regex}\" in:\n${output}")
+    endif()
+endfunction()
+
+# Result cache: passing tests are skipped on the next run, failing ones
+# never are, and MTEST_CACHE_ENV variables are part of the key
+run_basic(out OkTest IsPrimeTest --mtest-cache cache)
+expect_match(cache "${out}" "OkTest \\.\\.\\. OK ")
+
+run_basic(out OkTest IsPrimeTest --mtest-cache cache)
+expect_match(cache "${out}" "OkTest \\.\\.\\. CACHED")
+expect_match(cache "${out}" "IsPrimeTest \\.\\.\\. FAILED")
+
+set(ENV{MTEST_CACHE_ENV} CHECK_CACHE_VALUE)
+set(ENV{CHECK_CACHE_VALUE} 1)
+run_basic(out OkTest IsPrimeTest --mtest-cache cache)
+expect_match(cache "${out}" "OkTest \\.\\.\\. OK ")
+
+run_basic(out OkTest IsPrimeTest --mtest-cache cache)
+expect_match(cache "${out}" "OkTest \\.\\.\\. CACHED")
+
+set(ENV{CHECK_CACHE_VALUE} 2)
+run_basic(out OkTest IsPrimeTest --mtest-cache cache)
+expect_match(cache "${out}" "OkTest \\.\\.\\. OK ")
+
+run_basic(out --mtest-cache cache --mtest-cache-prune)
+expect_match(cache "${out}" "Removed 2 stale cache entries")
+
+file(GLOB records ${WORK_DIR}/cache/*)
+list(LENGTH records count)
+if (NOT count EQUAL 1)
+    message(FATAL_ERROR "cache: expected 1 record after pruning, found ${count}")
+endif()
+
+unset(ENV{MTEST_CACHE_ENV})
+unset(ENV{CHECK_CACHE_VALUE})
+message("check cache: ok")
+
+# Traces: the file is valid JSON, each test has a span on its worker's
+# track and MT_TRACE_SCOPE() spans nest inside the test's span
+run_basic(out OkTest TraceScopeTest --mtest-trace trace.json)
+file(READ ${WORK_DIR}/trace.json trace)
+string(JSON count ERROR_VARIABLE error LENGTH "${trace}" traceEvents)
+if (error)
+    message(FATAL_ERROR "trace: trace.json isn't valid: ${error}")
+endif()
+
+set(workers "")
+math(EXPR last "${count} - 1")
+foreach(i RANGE ${last})
+    string(JSON name GET "${trace}" traceEvents ${i} name)
+    string(JSON ph GET "${trace}" traceEvents ${i} ph)
+    string(JSON tid GET "${trace}" traceEvents ${i} tid)
+
+    if (ph STREQUAL "M")
+        string(JSON thread GET "${trace}" traceEvents ${i} args name)
+        if (thread MATCHES "^worker ")
+            list(APPEND workers ${tid})
+        endif()
+    elseif (name MATCHES "^(OkTest|TraceScopeTest|fill|check)$")
+        string(JSON ts GET "${trace}" traceEvents ${i} ts)
+        string(JSON dur GET "${trace}" traceEvents ${i} dur)
+        set(${name}_tid ${tid})
+        set(${name}_begin ${ts})
+        math(EXPR ${name}_end "${ts} + ${dur}")
+    endif()
+endforeach()
+
+foreach(span OkTest TraceScopeTest fill check)
+    if (NOT DEFINED ${span}_tid)
+        message(FATAL_ERROR "trace: no span named ${span} in:\n${trace}")
+    endif()
+endforeach()
+
+foreach(test OkTest TraceScopeTest)
+    if (NOT ${test}_tid IN_LIST workers)
+        message(FATAL_ERROR "trace: ${test} isn't on a worker's track in:\n${trace}")
+    endif()
+endforeach()
+
+# Timestamps and durations are truncated to whole microseconds
+math(EXPR test_end "${TraceScopeTest_end} + 1")
+foreach(span fill check)
+    if (NOT ${span}_tid EQUAL TraceScopeTest_tid
+        OR ${span}_begin LESS TraceScopeTest_begin
+        OR ${span}_end GREATER test_end)
+        message(FATAL_ERROR "trace: ${span} isn't nested in TraceScopeTest in:\n${trace}")
+    endif()
+endforeach()
+message("check trace: ok")
+
+# Lightweight header: light.cpp builds with MTEST_LIGHT, and values in
+# failures are still printed, without <ostream> in the test's source
+set(ENV{BASIC_CHECK_FAILURES} 1)
+run_basic(out LightHeaderTest LightFailureTest)
+unset(ENV{BASIC_CHECK_FAILURES})
+expect_match(light "${out}" "LightHeaderTest \\.\\.\\. OK ")
+expect_match(light "${out}" "\"ptr != nullptr\": \"0\" !!= \"nullptr\"")
+expect_match(light "${out}" "\"CHANNEL_LEFT == CHANNEL_RIGHT\": \"0\" !== \"1\"")
+expect_match(light "${out}" "\"Mode::Off == Mode::On\": \"0\" !== \"1\"")
+expect_match(light "${out}" "\"2\\.5 == 0\\.5\": \"2\\.5\" !== \"0\\.5\"")
+message("check light: ok")
+
+# Buffer assertions: MemKernelTest and NearAllTest compare the SSE2/AVX2
+# kernels with plain loops in process, BufferFailureTest checks the counts
+# reported for unaligned buffers with differences in the tail
+set(ENV{BASIC_CHECK_FAILURES} 1)
+run_basic(out MemKernelTest NearAllTest BufferFailureTest)
+unset(ENV{BASIC_CHECK_FAILURES})
+expect_match(buffers "${out}" "MemKernelTest \\.\\.\\. OK ")
+expect_match(buffers "${out}" "NearAllTest \\.\\.\\. OK ")
+expect_match(buffers "${out}" "\\(100 bytes\\): 3 bytes differ, first at offset 0x2\n")
+expect_match(buffers "${out}" "\\(37 values, tolerance 0\\.1\\): 2 values differ, first at index 3\n")
+expect_match(buffers "${out}" "\\(63 values, tolerance 0\\.1\\): 2 values differ, first at index 1\n")
+expect_match(buffers "${out}" "1 of 45 elements differ, first at index 44: \"3\" != \"4\"")
+message("check buffers: ok")
+
+# Golden files: a mismatch writes <path>.actual and isn't hidden by the
+# cache, --mtest-update-golden replaces the golden file
+file(COPY ${CMAKE_CURRENT_LIST_DIR}/golden DESTINATION ${WORK_DIR})
+file(READ ${WORK_DIR}/golden/primes.txt expected)
+
+run_basic(out GoldenTest OkTest --mtest-cache golden_cache)
+expect_match(golden "${out}" "GoldenTest \\.\\.\\. OK ")
+
+run_basic(out GoldenTest OkTest --mtest-cache golden_cache)
+expect_match(golden "${out}" "GoldenTest \\.\\.\\. CACHED")
+
+file(WRITE ${WORK_DIR}/golden/primes.txt "2\n3\n4\n")
+run_basic(out GoldenTest OkTest --mtest-cache golden_cache)
+expect_match(golden "${out}" "GoldenTest \\.\\.\\. FAILED")
+expect_match(golden "${out}" "sizes differ \\(6 != 71 bytes\\), first difference at offset 0x4")
+
+file(READ ${WORK_DIR}/golden/primes.txt.actual actual)
+if (NOT actual STREQUAL expected)
+    message(FATAL_ERROR "golden: primes.txt.actual doesn't hold the test's output")
+endif()
+
+run_basic(out GoldenTest OkTest --mtest-cache golden_cache --mtest-update-golden)
+expect_match(golden "${out}" "Updated 1 golden file")
+
+file(READ ${WORK_DIR}/golden/primes.txt updated)
+if (NOT updated STREQUAL expected)
+    message(FATAL_ERROR "golden: --mtest-update-golden didn't restore primes.txt")
+endif()
+
+# The updating run stored a record of the new golden file
+run_basic(out GoldenTest OkTest --mtest-cache golden_cache)
+expect_match(golden "${out}" "GoldenTest \\.\\.\\. CACHED")
+message("check golden: ok")
+
+# Parallel tests: every index is visited once on one worker or several,
+# and idle workers steal queued tasks
+run_basic(out ParallelForTest OkTest --mtest-threads 1)
+expect_match(parallel "${out}" "ParallelForTest \\.\\.\\. OK ")
+
+set(ENV{BASIC_CHECK_STEALING} 1)
+run_basic(out ParallelForTest TaskStealingTest --mtest-threads 4)
+unset(ENV{BASIC_CHECK_STEALING})
+expect_match(parallel "${out}" "ParallelForTest \\.\\.\\. OK ")
+expect_match(parallel "${out}" "TaskStealingTest \\.\\.\\. OK ")
+message("check parallel: ok")
+
+# Time budgets: durations recorded in the history keep tests which can't
+# finish in the budget from starting, the others still run
+run_basic(out OkTest IsPrimeTest LongTest1 LongTest2 --mtest-threads 1 --mtest-history history)
+expect_match(budget "${out}" "LongTest1 \\.\\.\\. OK ")
+
+run_basic(out OkTest IsPrimeTest LongTest1 LongTest2 --mtest-threads 1 --mtest-history history
+    --mtest-time-budget 0.02)
+expect_match(budget "${out}" "Skipped 2 tests to fit the time budget: LongTest[12] LongTest[12]\n")
+expect_match(budget "${out}" "OkTest \\.\\.\\. OK ")
+expect_match(budget "${out}" "IsPrimeTest \\.\\.\\. FAILED")
+expect_no_match(budget "${out}" "LongTest[12] \\.\\.\\.")
+
+run_basic(out OkTest IsPrimeTest LongTest1 LongTest2 --mtest-threads 1 --mtest-history history
+    --mtest-time-budget 10)
+expect_no_match(budget "${out}" "Skipped")
+expect_match(budget "${out}" "LongTest2 \\.\\.\\. OK ")
+message("check budget: ok")
+
+# Test logs: passing tests don't print theirs, a failing test prints the
+# last 64 KiB, and --mtest-capture adds std::cout, std::cerr and its tasks'
+# output to the log
+run_basic(out LogRingTest OkTest)
+expect_match(logs "${out}" "LogRingTest \\.\\.\\. OK ")
+expect_no_match(logs "${out}" "ring line")
+
+set(ENV{BASIC_CHECK_FAILURES} 1)
+run_basic(out LogRingTest LogCaptureTest --mtest-capture --mtest-threads 4)
+unset(ENV{BASIC_CHECK_FAILURES})
+
+# "ring line <n>\n" lines from 5631 to 9999 make up the last 64 KiB
+expect_match(logs "${out}" "\\(earlier output dropped, 64 KiB kept\\)\n      ring line 5631\n")
+expect_match(logs "${out}" "\n      ring line 9999\n")
+expect_no_match(logs "${out}" "ring line 5630\n")
+
+foreach(line "written to cout" "written to cerr" "logged from task 0" "logged from task 3")
+    expect_match(logs "${out}" "\n      ${line}\n")
+endforeach()
+message("check logs: ok")
+
+# Streaming runs: the failure summary read back from the spill file
+# matches the one kept in memory, logs included, and walking the registry
+# runs every test
+run_basic(out IsPrimeTest OkTest BasicTest --mtest-threads 1)
+string(FIND "${out}" "SUMMARY OF" pos)
+string(SUBSTRING "${out}" ${pos} -1 expected)
+
+run_basic(out IsPrimeTest OkTest BasicTest --mtest-threads 1 --mtest-stream)
+string(FIND "${out}" "SUMMARY OF" pos)
+string(SUBSTRING "${out}" ${pos} -1 streamed)
+
+if (NOT streamed STREQUAL expected)
+    message(FATAL_ERROR "stream: summary differs from a normal run:\n${streamed}\nexpected:\n${expected}")
+endif()
+expect_match(stream "${out}" "SUMMARY OF 2 FAILED TESTS")
+
+set(ENV{BASIC_CHECK_FAILURES} 1)
+run_basic(out LogRingTest OkTest --mtest-stream)
+unset(ENV{BASIC_CHECK_FAILURES})
+expect_match(stream "${out}" "LogRingTest:\n")
+expect_match(stream "${out}" "\\(earlier output dropped, 64 KiB kept\\)\n      ring line 5631\n")
+expect_match(stream "${out}" "\n      ring line 9999\n")
+
+run_basic(out --mtest-stream --mtest-threads 4)
+string(REGEX MATCH "TEST RUN \\(([0-9]+) total\\)" header "${out}")
+set(total "${CMAKE_MATCH_1}")
+string(REGEX MATCHALL " \\.\\.\\. (OK|FAILED) " results "${out}")
+list(LENGTH results count)
+if (NOT header OR NOT count EQUAL total)
+    message(FATAL_ERROR "stream: ran ${count} tests, expected ${total}:\n${out}")
+endif()
+expect_match(stream "${out}" "SUMMARY OF 3 FAILED TESTS")
+
+foreach(test IsPrimeTest BasicTest ComparisonTest)
+    expect_match(stream "${out}" "\n${test}:\n")
+endforeach()
+
+run_basic(out --mtest-stream --mtest-time-budget 1)
+expect_match(stream "${out}" "ERROR: --mtest-stream can't be combined with --mtest-time-budget")
+message("check stream: ok")
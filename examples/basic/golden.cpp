@@ -0,0 +1,20 @@
+#include "../../mtest.h"
+
+#include <sstream>
+#include <string>
+
+int is_prime(int n);
+
+// Compares the primes below 100 with golden/primes.txt, which is found
+// relative to the working directory. After changing the output, run the
+// example from this directory with --mtest-update-golden to update it.
+
+TEST(GoldenTest) {
+  std::stringstream ss;
+
+  for (int n = 0; n < 100; ++n)
+    if (is_prime(n))
+      ss << n << "\n";
+
+  EXPECT_MATCHES_GOLDEN(ss.str(), "golden/primes.txt");
+}
@@ -0,0 +1,36 @@
+#define MTEST_LIGHT
+#include "../../mtest.h"
+
+#include <cstdlib>
+
+// This file is built against the lightweight header, which only declares the
+// stream classes. Assertions on builtin types, pointers and enums still work.
+
+enum Channel { CHANNEL_LEFT, CHANNEL_RIGHT };
+enum class Mode : unsigned char { Off, On };
+
+TEST(LightHeaderTest) {
+  int value = 5;
+  int *ptr = &value;
+  const char *name = nullptr;
+
+  EXPECT_EQ(value, 5);
+  EXPECT_NE(ptr, nullptr);
+  EXPECT_EQ(name, nullptr);
+  EXPECT_EQ(CHANNEL_RIGHT, CHANNEL_RIGHT);
+  EXPECT_NE(CHANNEL_LEFT, CHANNEL_RIGHT);
+  EXPECT_NE(Mode::Off, Mode::On);
+}
+
+// Fails only when run by check.cmake, which checks how the values are printed
+TEST(LightFailureTest) {
+  if (!getenv("BASIC_CHECK_FAILURES"))
+    return;
+
+  int *ptr = nullptr;
+
+  EXPECT_NE(ptr, nullptr);
+  EXPECT_EQ(CHANNEL_LEFT, CHANNEL_RIGHT);
+  EXPECT_EQ(Mode::Off, Mode::On);
+  EXPECT_EQ(2.5, 0.5);
+}
@@ -0,0 +1,30 @@
+#include "../../mtest.h"
+
+#include <cstdlib>
+#include <iostream>
+
+// Logs are only printed when a test fails. These tests fail only when run
+// by check.cmake, which checks what their logs kept.
+
+TEST(LogRingTest) {
+  // About 140 KiB, more than the 64 KiB kept per test
+  for (int i = 0; i < 10000; ++i)
+    MT_LOG("ring line ", i);
+
+  EXPECT(!getenv("BASIC_CHECK_FAILURES"));
+}
+
+TEST(LogCaptureTest) {
+  if (!getenv("BASIC_CHECK_FAILURES"))
+    return;
+
+  // Only logged with --mtest-capture
+  std::cout << "written to cout" << std::endl;
+  std::cerr << "written to cerr" << std::endl;
+
+  MT_PARALLEL_FOR(i, 0, 4, {
+    MT_LOG("logged from task ", i);
+  });
+
+  EXPECT(false);
+}
@@ -0,0 +1,71 @@
+#include "../../mtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// MT_PARALLEL_FOR() and mtest_task_group run work on the worker pool that
+// --mtest-threads creates.
+
+TEST(ParallelForTest) {
+  const int n = 10000;
+  std::vector<std::atomic<int>> visits(n);
+
+  MT_PARALLEL_FOR(i, 0, n, {
+    visits[i]++;
+  });
+
+  for (int i = 0; i < n; ++i)
+    ASSERT_EQ(visits[i].load(), 1);
+
+  // Tasks may add tasks to their own group and start nested loops
+  std::atomic<int> total(0);
+  mtest_task_group group;
+
+  for (int t = 0; t < 8; ++t)
+    group.run([&group, &total]() {
+      group.run([&total]() { total++; });
+
+      MT_PARALLEL_FOR(j, 0, 100, {
+        total++;
+      });
+    });
+
+  group.wait();
+  EXPECT_EQ(total.load(), 8 * 101);
+}
+
+// Only check.cmake runs this with idle workers, so only it asks for the
+// check. The calling thread blocks in the first task it runs until another
+// worker has stolen one of the others.
+TEST(TaskStealingTest) {
+  if (!getenv("BASIC_CHECK_STEALING"))
+    return;
+
+  std::mutex lock;
+  std::set<std::thread::id> workers;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+  MT_PARALLEL_FOR(i, 0, 16, {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      workers.insert(std::this_thread::get_id());
+    }
+
+    while (std::chrono::steady_clock::now() < deadline) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (workers.size() > 1)
+          break;
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+
+  EXPECT_GT(workers.size(), 1u);
+}
@@ -0,0 +1,19 @@
+#include "../../mtest.h"
+
+#include <vector>
+
+// MT_TRACE_SCOPE() marks the phases of a test in the --mtest-trace output.
+
+TEST(TraceScopeTest) {
+  std::vector<int> squares;
+
+  {
+    MT_TRACE_SCOPE("fill");
+    for (int i = 0; i < 1000; ++i)
+      squares.push_back(i * i);
+  }
+
+  MT_TRACE_SCOPE("check");
+  for (int i = 0; i < 1000; ++i)
+    ASSERT_EQ(squares[i], i * i);
+}
@@ -0,0 +1,37 @@
+# Invoked by the compile_bench target, see CMakeLists.txt.
+# Prints one line per variant:
+#   compile variant=<name> tests=<n> assertions=<n> seconds=<s> object_bytes=<n>
+
+separate_arguments(flags UNIX_COMMAND "${CXX_FLAGS}")
+math(EXPR total "${TESTS} * ${ASSERTIONS}")
+
+foreach(variant default light)
+    set(defines "")
+    if (variant STREQUAL "light")
+        set(defines -DMTEST_LIGHT)
+    endif()
+
+    set(object ${OUTPUT_DIR}/compile_bench_${variant}.o)
+
+    string(TIMESTAMP start "%s%f")
+    execute_process(
+        COMMAND ${CXX} ${flags} ${defines} -I${MTEST_DIR} -c ${SOURCE} -o ${object}
+        RESULT_VARIABLE result)
+    string(TIMESTAMP end "%s%f")
+
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "compiling the ${variant} variant failed")
+    endif()
+
+    math(EXPR usec "${end} - ${start}")
+    math(EXPR whole "${usec} / 1000000")
+    math(EXPR frac "(${usec} % 1000000) / 1000")
+    string(LENGTH "${frac}" len)
+    while (len LESS 3)
+        set(frac "0${frac}")
+        string(LENGTH "${frac}" len)
+    endwhile()
+
+    file(SIZE ${object} size)
+    message("compile variant=${variant} tests=${TESTS} assertions=${total} seconds=${whole}.${frac} object_bytes=${size}")
+endforeach()
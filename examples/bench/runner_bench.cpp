@@ -0,0 +1,67 @@
+/*
+ * Synthetic test suite for measuring mtest's own overhead. Registers
+ * <count> identical tests and passes the remaining arguments to mtest.
+ *
+ * Usage: runner_bench <count> <empty|short|failing> [mtest arguments]
+ */
+#include "../../mtest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+static void bench_empty(void *) {}
+
+static void bench_short(void *__self)
+{
+  volatile unsigned sum = 0;
+
+  for (unsigned i = 0; i < 10000; ++i)
+    sum += i;
+
+  EXPECT(sum);
+}
+
+static void bench_failing(void *__self)
+{
+  EXPECT_EQ(1, 2);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s <count> <empty|short|failing> [mtest arguments]\n", argv[0]);
+    return -1;
+  }
+
+  int count = atoi(argv[1]);
+  void (*tfun)(void *) = NULL;
+
+  if (!strcmp(argv[2], "empty"))
+    tfun = bench_empty;
+  else if (!strcmp(argv[2], "short"))
+    tfun = bench_short;
+  else if (!strcmp(argv[2], "failing"))
+    tfun = bench_failing;
+
+  if (count <= 0 || !tfun)
+  {
+    fprintf(stderr, "invalid test count or kind\n");
+    return -1;
+  }
+
+  // Test names must outlive the run
+  static std::vector<std::string> names(count);
+
+  for (int i = 0; i < count; ++i)
+  {
+    names[i] = "Bench" + std::to_string(i);
+    _mtest_push(names[i].c_str(), tfun);
+  }
+
+  return mtest_main(argc - 3, argv + 3);
+}
@@ -0,0 +1,181 @@
+/*
+ * Runs runner_bench over a range of suite sizes and prints one line per
+ * measurement, in a stable key=value format:
+ *
+ *   runner kind=<k> tests=<n> output=<pipe|tty> seconds=<s> us_per_test=<us>
+ *          peak_kb=<kb> bytes=<n> bytes_per_sec=<n>
+ *   startup tests=<n> seconds=<s> peak_kb=<kb>
+ *   derived tests=<n> dispatch_us_per_test=<us> failure_us_per_test=<us>
+ *
+ * Usage: runner_bench_driver <runner_bench> <size>...
+ *
+ * Requires a POSIX host; TTY output is measured through a pseudoterminal.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Result
+{
+  double seconds;
+  long peak_kb;
+  size_t bytes;
+};
+
+static bool run(const char *runner, vector<string> args, bool tty, Result *out)
+{
+  int master = -1, slave = -1;
+  int fds[2];
+
+  if (tty)
+  {
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) || unlockpt(master))
+      return false;
+
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+
+    if (slave < 0)
+      return false;
+
+    struct winsize ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+    ioctl(slave, TIOCSWINSZ, &ws);
+  }
+  else
+  {
+    if (pipe(fds))
+      return false;
+
+    master = fds[0];
+    slave = fds[1];
+  }
+
+  auto start = chrono::steady_clock::now();
+  pid_t pid = fork();
+
+  if (pid < 0)
+    return false;
+
+  if (!pid)
+  {
+    vector<char *> argv;
+
+    argv.push_back((char *)runner);
+    for (auto &a : args)
+      argv.push_back((char *)a.c_str());
+    argv.push_back(NULL);
+
+    if (tty)
+      setsid();
+
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(master);
+    close(slave);
+
+    execv(runner, argv.data());
+    _exit(127);
+  }
+
+  close(slave);
+
+  char buf[65536];
+  ssize_t len;
+
+  out->bytes = 0;
+
+  // Reading the pty master fails with EIO once the child has exited
+  while ((len = read(master, buf, sizeof(buf))) > 0)
+    out->bytes += len;
+
+  close(master);
+
+  int status;
+  struct rusage usage;
+
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return false;
+
+  out->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  out->peak_kb = usage.ru_maxrss;
+
+  // Failing suites exit nonzero, only treat exec failures as errors
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 127;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s <runner_bench> <size>...\n", argv[0]);
+    return -1;
+  }
+
+  const char *runner = argv[1];
+  static const char *kinds[] = { "empty", "short", "failing" };
+
+  for (int i = 2; i < argc; ++i)
+  {
+    string tests = argv[i];
+    double empty_seconds = 0.0, failing_seconds = 0.0;
+    Result r;
+
+    // A single selected test: registration, startup and teardown only
+    if (!run(runner, { tests, "empty", "Bench0" }, false, &r))
+    {
+      fprintf(stderr, "failed to run %s\n", runner);
+      return -1;
+    }
+
+    double startup = r.seconds;
+    printf("startup tests=%s seconds=%.6f peak_kb=%ld\n", tests.c_str(), r.seconds, r.peak_kb);
+    fflush(stdout);
+
+    for (const char *kind : kinds)
+      for (int tty = 0; tty < 2; ++tty)
+      {
+        if (!run(runner, { tests, kind }, tty, &r))
+        {
+          fprintf(stderr, "failed to run %s\n", runner);
+          return -1;
+        }
+
+        printf("runner kind=%s tests=%s output=%s seconds=%.6f us_per_test=%.3f "
+               "peak_kb=%ld bytes=%zu bytes_per_sec=%.0f\n",
+               kind, tests.c_str(), tty ? "tty" : "pipe", r.seconds,
+               r.seconds * 1e6 / atof(tests.c_str()), r.peak_kb, r.bytes,
+               r.bytes / r.seconds);
+        fflush(stdout);
+
+        if (!tty && !strcmp(kind, "empty"))
+          empty_seconds = r.seconds;
+        else if (!tty && !strcmp(kind, "failing"))
+          failing_seconds = r.seconds;
+      }
+
+    double n = atof(tests.c_str());
+
+    printf("derived tests=%s dispatch_us_per_test=%.3f failure_us_per_test=%.3f\n",
+           tests.c_str(), (empty_seconds - startup) * 1e6 / n,
+           (failing_seconds - empty_seconds) * 1e6 / n);
+    fflush(stdout);
+  }
+
+  return 0;
+}
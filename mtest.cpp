@@ -12,12 +12,46 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <direct.h>
 #else
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
 
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MTEST_SSE2
+#endif
+
+// AVX2 kernels are compiled separately and selected at runtime
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define MTEST_AVX2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <ctype.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #include <math.h>
 #include <stdio.h>
@@ -25,8 +59,12 @@
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <iomanip>
 #include <map>
@@ -42,24 +80,125 @@ using namespace std;
 #define BLUE 2
 #define RESET 3
 
-#define BWAIT 10
 #define STATUS_WAIT 10
 
+#define PERF_EVENTS 4
+
+#define HEX_ROW 16
+
+#define LOG_RING_SIZE (64 * 1024) // bytes of log kept per test
+
+#define HISTORY_ALPHA 0.3 // weight of the latest duration in the moving average
+#define BUDGET_FILL 0.8   // share of the time budget planned for up front
+
+// Default for --mtest-timeout, in seconds (0 for no limit)
+#ifndef MTEST_TIMEOUT
+#define MTEST_TIMEOUT 60
+#endif
+
+#define FUZZ_MAP_SIZE 65536 // coverage map entries, a power of two
+#define FUZZ_MAX_LEN 4096   // longest input generated by mutation
+
+// Coverage callbacks must not be instrumented themselves
+#if defined(__clang__)
+#define MT_NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#elif defined(__GNUC__) && __GNUC__ >= 12
+#define MT_NO_COVERAGE __attribute__((no_sanitize_coverage))
+#else
+#define MT_NO_COVERAGE
+#endif
+
 static void mtest_status_main();
 static void mtest_thread_main(void *ud);
+static void mtest_async_main(void *ud);
+static void mtest_fuzz_main(void *ud);
+
+struct Counters
+{
+  Counters() : software(false), valid(false) { memset(values, 0, sizeof(values)); }
+
+  // Hardware: cycles, instructions, cache misses, branch misses.
+  // Software: task clock (ns), context switches, page faults, migrations.
+  bool software;
+  bool valid;
+  uint64_t values[PERF_EVENTS];
+};
+
+// Bounded log of one test. The buffer grows with the log until it holds
+// LOG_RING_SIZE bytes, after which only the newest bytes are kept.
+struct LogRing
+{
+  LogRing() : written(0) {}
+
+  mutex mut; // tasks of the test may log concurrently
+  vector<char> data;
+  size_t written;
+};
 
 struct Test
 {
-  Test(void(*tfun)(void*), const char* name) : tfun(tfun), name(name) {}
+  Test(void(*tfun)(void*), const char* name, bool async = false)
+    : tfun(tfun), ffun(nullptr), name(name), async(async), log(nullptr), ran(false),
+      failed(false), wall_ms(-1) {}
 
-  void (*tfun)(void*);
+  void (*tfun)(void*); // starts the coroutine for asynchronous tests
+  void (*ffun)(void*, const uint8_t*, size_t); // body of fuzz tests
   const char* name;
-  vector<stringstream> failures;
+  bool async;
+  vector<string> failures;
+  Counters counters;
+  LogRing *log; // allocated on the first log line
+  vector<string> goldens; // golden files compared, hashed into the cache record
+  bool ran;
+  bool failed;
+  double wall_ms; // -1 unless the test body ran (not cached)
+};
+
+// Per-test record in the --mtest-history file. Runs are numbered from 0.
+struct History
+{
+  History() : ewma_ms(-1), first_seen(0), last_run(-1), last_fail(-1) {}
+
+  double ewma_ms; // moving average of the wall time, -1 if never timed
+  long first_seen;
+  long last_run;
+  long last_fail;
+};
+
+struct TaskGroup
+{
+  TaskGroup() : pending(0) {}
+
+  atomic<int> pending;
+};
+
+struct Task
+{
+  void (*fn)(void*);
+  void *arg;
+  TaskGroup *group;
+  Test *owner; // test which queued the task, receives its captured output
+};
+
+// Sends output written on a thread running a test to that test's log and
+// everything else to the original stream buffer.
+class CaptureBuf : public streambuf
+{
+public:
+  CaptureBuf(streambuf *orig) : orig(orig) {}
+
+  streambuf *orig;
+
+protected:
+  int overflow(int ch);
+  streamsize xsputn(const char *s, streamsize n);
+  int sync();
 };
 
 struct Thread
 {
-  Thread(bool quiet = false) : handle(mtest_thread_main, this), mut(), req(-1), quiet(quiet) {}
+  Thread(bool quiet = false, int index = 0)
+    : mut(), req(-1), quiet(quiet), index(index), handle(mtest_thread_main, this) {}
 
   void set_req(int val)
   {
@@ -86,12 +225,96 @@ struct Thread
     return target;
   }
 
-  thread handle;
   mutex mut;
   string target;
   int req; // -2: done, -1: idle, >=0: working
   bool quiet;
+  int index;
+  deque<Task> tasks; // owner pushes and pops at the back, thieves take the front
+  thread handle; // started last, once the fields above are initialized
+};
+
+struct Fuzzer
+{
+  Fuzzer(Test &test, const string &dir)
+    : test(test), dir(dir), seen(FUZZ_MAP_SIZE), covered(0), stop(false), execs(0) {}
+
+  Test &test;
+  string dir;
+
+  mutex mut; // guards everything below
+  vector<string> corpus;
+  vector<uint8_t> seen; // coverage of the whole corpus
+  size_t covered;
+  bool stop;
+  string crash;
+  vector<string> failures;
+
+  atomic<long long> execs;
+};
+
+struct TraceEvent
+{
+  const char *name;
+  const char *cat;
+  long long ts;  // microseconds since the start of the run
+  long long dur;
+  const Test *test; // for test spans, and spans recorded by asynchronous tests
+};
+
+// Each thread appends only to its own buffer, so recording takes no locks.
+struct TraceBuffer
+{
+  TraceBuffer(const string &name, int tid) : name(name), tid(tid) {}
+
+  string name;
+  int tid;
+  vector<TraceEvent> events;
+};
+
+struct MappedFile
+{
+  MappedFile() : data(nullptr), size(0) {}
+
+  const void *data;
+  size_t size;
+};
+
+#ifdef __linux__
+struct Waiter
+{
+  void (*resume)(void*);
+  void (*destroy)(void*); // ends the coroutine of a test which timed out
+  void *handle;
+  int fd; // -1 for timers
+  Test *test; // receives output captured while the coroutine runs
+  bool write;
+};
+
+struct AsyncLoop
+{
+  AsyncLoop(bool quiet)
+    : epfd(epoll_create1(0)), wakefd(eventfd(0, 0)), closing(false),
+      running(0), quiet(quiet), handle(mtest_async_main, this) {}
+
+  int epfd;
+  int wakefd;
+
+  mutex mut;
+  vector<Test*> pending;
+  bool closing;
+
+  // Only touched by the loop thread
+  int running;
+  map<Test*, chrono::steady_clock::time_point> started;
+  multimap<chrono::steady_clock::time_point, Waiter> timers;
+  multimap<chrono::steady_clock::time_point, Test*> deadlines; // of started tests
+  map<int, vector<Waiter>> fd_waiters; // in arrival order, per descriptor
+  bool quiet;
+
+  thread handle; // started last, once the fields above are initialized
 };
+#endif
 
 mutex out_mutex;
 thread status_thread;
@@ -103,6 +326,64 @@ static int total_tested;
 static int failed_tests;
 static int max_testlen;
 static int total_to_run;
+static int total_cached;
+
+static string cache_dir;
+static uint64_t cache_base; // hash of the test binary and environment
+
+#ifdef __linux__
+static AsyncLoop *async_loop;
+#endif
+static double async_timeout = MTEST_TIMEOUT; // seconds
+
+static bool trace_enabled;
+static string trace_path;
+static chrono::steady_clock::time_point trace_epoch;
+static mutex trace_mutex; // guards trace_buffers
+static vector<TraceBuffer*> trace_buffers;
+static thread_local TraceBuffer *trace_local;
+
+static mutex pool_mutex;           // pairs with pool_cv, guards pool_inject
+static condition_variable pool_cv; // new tasks, finished groups, worker state changes
+static deque<Task> pool_inject;    // tasks queued from outside the worker pool
+static atomic<int> pool_queued;
+static thread_local Thread *pool_worker;
+static thread_local Test *current_test; // test running on this thread, if any
+
+static mutex log_mutex; // guards allocation of LogRings
+static bool log_capture;
+static CaptureBuf *capture_out;
+static CaptureBuf *capture_err;
+
+static mutex failure_mutex; // tests may fail from several threads at once
+
+static string fuzz_target;
+static double fuzz_seconds = 60;
+static string corpus_dir = "corpus";
+static thread_local uint8_t *fuzz_map; // set on fuzzing threads only
+static thread_local const string *fuzz_input;
+static char fuzz_crash_prefix[4096];
+
+static bool stream_mode;
+static FILE *spill; // failure reports of finished tests in streaming runs
+
+static double time_budget; // seconds, 0 for no limit
+static string history_path;
+static map<string, History> history;
+static long history_run; // number of the current run
+static double history_median = 100; // estimate in ms for untimed tests
+
+static bool golden_update;
+static int golden_updated;
+static mutex golden_mutex; // serializes golden and .actual writes
+
+static bool perf_enabled;
+static atomic<bool> perf_unavailable; // a worker couldn't open any counters
+static Counters perf_totals[2]; // hardware, software
+static mutex perf_mutex; // tasks of a test may add to its counters from several workers
+static thread_local int *perf_local; // counters of this worker, if open
+static thread_local bool perf_local_software;
+static thread_local uint64_t perf_foreign[PERF_EVENTS]; // other tests' tasks run in this test
 
 static int _get_terminal_width();
 static void _clear_row();
@@ -111,6 +392,91 @@ static void _print_centered_header(const char *fmt, ...);
 static void _set_color(int col);
 static void _cleanup();
 static void _wait(int ms);
+static void _finish_test(Test &test, bool quiet, bool cached, long ms);
+static void _add_failure(void *self, const string &msg);
+static void _pool_notify();
+static bool _pool_take(Task *out);
+static void _pool_run(Task &task);
+static Thread *_idle_worker();
+static bool _all_idle();
+static void _fail_header(stringstream &ss, const char *file, int line, bool assertion,
+                         const char *lhs, const char *op, const char *rhs);
+static void _hex_window(stringstream &ss, const char *aname, const unsigned char *a, size_t alen,
+                        const char *bname, const unsigned char *b, size_t blen, size_t first);
+static bool _map_file(const char *path, MappedFile *out);
+static void _unmap_file(MappedFile *file);
+static bool _write_file(const string &path, const void *data, size_t size);
+static bool _replace_file(const char *path, const void *data, size_t size);
+static bool _read_file(const string &path, string *out);
+static void _make_dir(const string &path);
+static bool _list_dir(const string &path, vector<string> *out);
+static bool _history_load();
+static bool _history_save();
+static double _test_value(const string &name);
+static double _test_estimate(const string &name);
+static void _budget_select(vector<string> &to_run, int num_threads, vector<string> *skipped);
+static void _log_append(Test *test, const char *data, size_t len);
+static void _log_print(ostream &os, Test &test);
+static void _print_failures(ostream &os, Test &test, bool quiet);
+static void _fuzz_replay(void *self);
+static int _fuzz_run(Fuzzer &fz, int num_threads);
+static bool _fuzz_exec(Test &scratch, const string &input);
+static bool _fuzz_merge(Fuzzer &fz, vector<uint8_t> &local, const string &input);
+static void _fuzz_mutate(string &buf, const string &other, uint64_t *rng);
+static string _fuzz_minimize(Test &scratch, string input);
+static string _fuzz_save(const string &dir, const char *prefix, const string &data);
+static void _fuzz_signal(int sig);
+static uint64_t _rand64(uint64_t *state);
+static int _popcount32(uint32_t val);
+static int _ctz32(uint32_t val);
+static uint32_t _fold_mask(uint32_t diff, size_t elem);
+#ifdef MTEST_SSE2
+static size_t _mem_scan_sse2(const unsigned char *a, const unsigned char *b, size_t len,
+                             size_t elem, size_t *first, size_t *mismatches);
+#endif
+#ifdef MTEST_AVX2
+static size_t _mem_scan_avx2(const unsigned char *a, const unsigned char *b, size_t len,
+                             size_t elem, size_t *first, size_t *mismatches);
+#endif
+template <typename T>
+static size_t _near_mismatches(const T *a, const T *b, size_t count, double tol,
+                               bool ulp, size_t *first);
+template <typename T>
+static bool _near_all(void *self, const char *file, int line, bool assertion,
+                      const char *lhs, const char *rhs, const T *a, const T *b,
+                      size_t count, double tol, bool ulp);
+static void _async_submit(Test *test, bool quiet);
+#ifdef __linux__
+static void _async_resume(Waiter &w);
+static int _async_watch(AsyncLoop *loop, int fd, bool modify);
+static void _async_ready(AsyncLoop *loop, int fd, uint32_t events);
+static void _async_expire(AsyncLoop *loop, Test *test);
+void _mtest_async_done(void *self); // declared by mtest.h only with coroutines
+#endif
+static void _async_finish();
+static void _trace_register(const string &name);
+static long long _trace_us(chrono::steady_clock::time_point t);
+static void _trace_span(const char *name, const char *cat, long long start,
+                        const Test *test = nullptr);
+static void _trace_args(FILE *fp, const Counters &c);
+static void _trace_escape(FILE *fp, const char *str);
+static bool _trace_write();
+static uint64_t _hash_bytes(uint64_t h, const void *data, size_t len);
+static bool _hash_file(uint64_t *h, const char *path);
+static bool _hash_binary(uint64_t *h);
+static uint64_t _hash_env(uint64_t h);
+static string _cache_path(const char *name);
+static bool _cache_lookup(const char *name);
+static void _cache_store(Test &test);
+static int _cache_prune();
+static bool _perf_open(int *fds, bool *software);
+static void _perf_close(int *fds);
+static void _perf_start(int *fds);
+static void _perf_stop(int *fds, Counters *out);
+static bool _perf_read(int *fds, uint64_t *values);
+static void _perf_add(Test *test, const Counters &c, bool software);
+static string _perf_format(const Counters &c);
+static string _perf_count(double val);
 
 int mtest_main(int argc, char **argv)
 {
@@ -119,6 +485,7 @@ int mtest_main(int argc, char **argv)
   struct tm *t = localtime(&now);
 
   clock_t tstart_time = clock();
+  trace_epoch = chrono::steady_clock::now();
 
   strftime(datestr, sizeof(datestr) - 1, "%m/%d/%Y %H:%H", t);
 
@@ -144,19 +511,40 @@ int mtest_main(int argc, char **argv)
     }
   }
 
+  char* env_cache = getenv("MTEST_CACHE");
+
+  if (env_cache)
+    cache_dir = env_cache;
+
   vector<string> to_run;
   bool selected = false;
+  bool prune_cache = false;
 
   // Parse arguments
   for (int i = 0; i < argc; ++i)
   {
     if (string(argv[i]) == "--mtest-help") {
       cout << "TEST OPTIONS:" << endl;
-      cout << "    --mtest-help          | Displays this message." << endl;
-      cout << "    --mtest-threads <num> | Sets the number of parallel tests." << endl;
-      cout << "    --enum-tests          | Enumerates the available tests." << endl;
+      cout << "    --mtest-help            | Displays this message." << endl;
+      cout << "    --mtest-threads <num>   | Sets the number of parallel tests." << endl;
+      cout << "    --mtest-cache <dir>     | Skips tests which passed with an identical binary." << endl;
+      cout << "    --mtest-cache-prune     | Removes stale entries from the cache and exits." << endl;
+      cout << "    --mtest-perf            | Collects performance counters for each test." << endl;
+      cout << "    --mtest-trace <file>    | Writes a Chrome trace of the test run." << endl;
+      cout << "    --mtest-update-golden   | Rewrites golden files which don't match." << endl;
+      cout << "    --mtest-time-budget <s> | Runs the most valuable tests that fit in <s> seconds." << endl;
+      cout << "    --mtest-history <file>  | Records test durations and results (default .mtest_history)." << endl;
+      cout << "    --mtest-timeout <s>     | Fails TEST_ASYNC tests running over <s> seconds (default "
+           << MTEST_TIMEOUT << ")." << endl;
+      cout << "    --mtest-capture         | Sends std::cout and std::cerr output of tests to their logs." << endl;
+      cout << "    --mtest-stream          | Releases test results as tests finish, for very large suites." << endl;
+      cout << "    --mtest-fuzz <name>     | Fuzzes a FUZZ_TEST on every thread." << endl;
+      cout << "    --mtest-fuzz-time <s>   | Stops fuzzing after <s> seconds (default 60)." << endl;
+      cout << "    --mtest-corpus <dir>    | Sets the fuzz corpus directory (default corpus)." << endl;
+      cout << "    --enum-tests            | Enumerates the available tests." << endl;
       cout << "Additional arguments are treated as the test run list." << endl;
       cout << "By default every test will be run." << endl;
+      cout << "Variables in MTEST_CACHE_ENV (comma separated) are included in cache keys." << endl;
       return 0;
     } else if (string(argv[i]) == "--mtest-threads")
     {
@@ -175,6 +563,133 @@ int mtest_main(int argc, char **argv)
         cout << "ERROR: invalid thread count to --mtest-threads" << endl;
         return -1;
       }
+    } else if (string(argv[i]) == "--mtest-cache")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-cache requires an argument" << endl;
+        return -1;
+      }
+
+      cache_dir = argv[i];
+    } else if (string(argv[i]) == "--mtest-cache-prune")
+    {
+      prune_cache = true;
+    } else if (string(argv[i]) == "--mtest-trace")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-trace requires an argument" << endl;
+        return -1;
+      }
+
+      trace_enabled = true;
+      trace_path = argv[i];
+    } else if (string(argv[i]) == "--mtest-time-budget")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-time-budget requires an argument" << endl;
+        return -1;
+      }
+
+      errno = 0;
+      time_budget = strtod(argv[i], NULL);
+
+      if (errno || time_budget <= 0) {
+        cout << "ERROR: invalid duration to --mtest-time-budget" << endl;
+        return -1;
+      }
+    } else if (string(argv[i]) == "--mtest-history")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-history requires an argument" << endl;
+        return -1;
+      }
+
+      history_path = argv[i];
+    } else if (string(argv[i]) == "--mtest-timeout")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-timeout requires an argument" << endl;
+        return -1;
+      }
+
+      errno = 0;
+      async_timeout = strtod(argv[i], NULL);
+
+      if (errno || async_timeout < 0) {
+        cout << "ERROR: invalid duration to --mtest-timeout" << endl;
+        return -1;
+      }
+    } else if (string(argv[i]) == "--mtest-capture")
+    {
+      log_capture = true;
+    } else if (string(argv[i]) == "--mtest-stream")
+    {
+      stream_mode = true;
+    } else if (string(argv[i]) == "--mtest-fuzz")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-fuzz requires an argument" << endl;
+        return -1;
+      }
+
+      fuzz_target = argv[i];
+    } else if (string(argv[i]) == "--mtest-fuzz-time")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-fuzz-time requires an argument" << endl;
+        return -1;
+      }
+
+      errno = 0;
+      fuzz_seconds = strtod(argv[i], NULL);
+
+      if (errno || fuzz_seconds <= 0) {
+        cout << "ERROR: invalid duration to --mtest-fuzz-time" << endl;
+        return -1;
+      }
+    } else if (string(argv[i]) == "--mtest-corpus")
+    {
+      i += 1;
+
+      if (i >= argc)
+      {
+        cout << "ERROR: --mtest-corpus requires an argument" << endl;
+        return -1;
+      }
+
+      corpus_dir = argv[i];
+    } else if (string(argv[i]) == "--mtest-update-golden")
+    {
+      golden_update = true;
+    } else if (string(argv[i]) == "--mtest-perf")
+    {
+#ifdef __linux__
+      perf_enabled = true;
+#else
+      cout << "ERROR: --mtest-perf is only supported on Linux" << endl;
+      return -1;
+#endif
     } else if (string(argv[i]) == "--enum-tests")
     {
       for (auto it = all_tests->begin(); it != all_tests->end(); ++it)
@@ -191,6 +706,47 @@ int mtest_main(int argc, char **argv)
     }
   }
 
+  if (cache_dir.size())
+  {
+    if (!_hash_binary(&cache_base))
+    {
+      cout << "ERROR: couldn't hash the test binary for --mtest-cache" << endl;
+      return -1;
+    }
+
+    cache_base = _hash_env(cache_base);
+  }
+
+  if (prune_cache)
+  {
+    if (!cache_dir.size())
+    {
+      cout << "ERROR: --mtest-cache-prune requires a cache directory" << endl;
+      return -1;
+    }
+
+    cout << "Removed " << _cache_prune() << " stale cache entries" << endl;
+    return 0;
+  }
+
+  if (stream_mode && time_budget)
+  {
+    cout << "ERROR: --mtest-stream can't be combined with --mtest-time-budget" << endl;
+    return -1;
+  }
+
+  if (fuzz_target.size())
+  {
+    if (!all_tests || !all_tests->count(fuzz_target) || !all_tests->at(fuzz_target).ffun)
+    {
+      cout << "ERROR: " << fuzz_target << " is not a fuzz test" << endl;
+      return -1;
+    }
+
+    Fuzzer fz(all_tests->at(fuzz_target), corpus_dir + "/" + fuzz_target);
+    return _fuzz_run(fz, num_threads);
+  }
+
   if (to_run.size() == 1)
     selected = true;
 
@@ -204,84 +760,134 @@ int mtest_main(int argc, char **argv)
     }
   }
 
-  if (!to_run.size())
+  // Streaming runs walk the registry instead of copying every name
+  bool lazy = stream_mode && !to_run.size();
+
+  if (!to_run.size() && !lazy)
     for (auto it = all_tests->begin(); it != all_tests->end(); ++it)
       to_run.push_back(it->first);
 
-  total_to_run = to_run.size();
+  if (stream_mode && !(spill = tmpfile()))
+  {
+    cout << "ERROR: couldn't create a spill file for --mtest-stream" << endl;
+    return -1;
+  }
+
+  if (time_budget && !history_path.size())
+    history_path = ".mtest_history";
+
+  if (history_path.size() && !_history_load())
+  {
+    cout << "ERROR: couldn't read history from " << history_path << endl;
+    return -1;
+  }
+
+  // Pick the tests which fit in the budget, most valuable first
+  vector<string> skipped;
+
+  if (time_budget)
+    _budget_select(to_run, num_threads, &skipped);
+
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::now()
+    + chrono::milliseconds((long long)(time_budget * 1000));
+
+  total_to_run = lazy ? all_tests->size() : to_run.size();
 
   if (!selected)
   {
-    _print_centered_header("TEST RUN (%d total): %s", to_run.size(), datestr);
+    _print_centered_header("TEST RUN (%d total): %s", total_to_run, datestr);
     cout << "    > Testing on " << num_threads << " threads" << endl;
   }
 
   // Determine name alignment
+  if (lazy)
+    for (auto it = all_tests->begin(); it != all_tests->end(); ++it)
+      max_testlen = max(max_testlen, (int)it->first.size());
+
   for (auto it = to_run.begin(); it != to_run.end(); ++it)
     if (it->size() > (unsigned) max_testlen) max_testlen = it->size();
 
+  if (trace_enabled)
+    _trace_register("dispatcher");
+
+  if (log_capture)
+  {
+    capture_out = new CaptureBuf(cout.rdbuf());
+    capture_err = new CaptureBuf(cerr.rdbuf());
+    cout.rdbuf(capture_out);
+    cerr.rdbuf(capture_err);
+  }
+
   // Initialize worker threads
   for (int i = 0; i < num_threads; ++i)
-    threads.push_back(new Thread(selected));
+    threads.push_back(new Thread(selected, i));
 
   // Initialize status thread
   if (!selected)
     status_thread = thread(mtest_status_main);
 
-  for (string test : to_run)
+  auto next = all_tests->begin();
+  size_t index = 0;
+
+  while (lazy ? next != all_tests->end() : index < to_run.size())
   {
-    // Wait for free worker
-    int assigned = 0;
-    while (!assigned)
+    string test = lazy ? (next++)->first : to_run[index++];
+
+    // Asynchronous tests all share the event loop
+    if (all_tests->at(test).async)
     {
-      for (auto& thr : threads)
-        if (thr->mut.try_lock())
-        {
-          if (thr->req == -1)
-          {
-            assigned = 1;
-            thr->req = 1;
-            thr->target = test;
-            thr->mut.unlock();
-            break;
-          }
-          else
-          {
-            thr->mut.unlock();
-          }
-        }
+      if (time_budget && chrono::steady_clock::now()
+          + chrono::microseconds((long long)(_test_estimate(test) * 1000)) > deadline)
+        skipped.push_back(test);
+      else
+        _async_submit(&all_tests->at(test), selected);
 
-      _wait(BWAIT);
+      continue;
     }
-  }
 
-  // Wait for each thread to complete
-  int done = 0;
-  while (!done)
-  {
-    done = 1;
+    // Wait for free worker
+    long long wait_start = _mtest_trace_now();
+    Thread *idle = nullptr;
 
-    for (auto &thr : threads)
     {
-      thr->mut.lock();
-
-      if (thr->req != -1)
-      {
-        done = 0;
-        thr->mut.unlock();
-        break;
-      }
+      unique_lock<mutex> lock(pool_mutex);
+      pool_cv.wait(lock, [&] { return (idle = _idle_worker()) != nullptr; });
+    }
 
-      thr->mut.unlock();
+    // Don't start tests which are expected to overrun the deadline
+    if (time_budget && chrono::steady_clock::now()
+        + chrono::microseconds((long long)(_test_estimate(test) * 1000)) > deadline)
+    {
+      skipped.push_back(test);
+      continue;
     }
 
-    _wait(BWAIT);
+    idle->set_target(test);
+    idle->set_req(1);
+    _pool_notify();
+
+    _trace_span("wait for worker", "dispatch", wait_start);
+  }
+
+  long long drain_start = _mtest_trace_now();
+
+  // Wait for the event loop to drain
+  _async_finish();
+
+  // Wait for each thread to complete
+  {
+    unique_lock<mutex> lock(pool_mutex);
+    pool_cv.wait(lock, _all_idle);
   }
 
+  _trace_span("wait for completion", "dispatch", drain_start);
+
   // Tell threads to stop
   for (auto &thr : threads)
     thr->set_req(-2);
 
+  _pool_notify();
+
   // Join remaining threads
   for (auto &thr : threads)
     thr->handle.join();
@@ -300,21 +906,59 @@ int mtest_main(int argc, char **argv)
       << (float)(tend_time - tstart_time) / CLOCKS_PER_SEC
       << " seconds" << endl;
 
+  if (!selected && total_cached)
+    cout << "    > " << total_cached << " tests skipped by cache" << endl;
+
+  if (skipped.size())
+  {
+    cout << "    > Skipped " << skipped.size() << " test" << (skipped.size() > 1 ? "s" : "")
+         << " to fit the time budget:";
+
+    for (auto &name : skipped)
+      cout << " " << name;
+
+    cout << endl;
+  }
+
+  if (history_path.size() && !_history_save())
+    cerr << "ERROR: couldn't write history to " << history_path << endl;
+
+  if (!selected && golden_updated)
+    cout << "    > Updated " << golden_updated << " golden file"
+         << (golden_updated > 1 ? "s" : "") << endl;
+
+  if (!selected)
+    for (auto &c : perf_totals)
+      if (c.valid)
+        cout << "    > Counted " << _perf_format(c) << endl;
+
+  if (!selected && perf_unavailable)
+    cout << "    > Couldn't open performance counters, see "
+         << "/proc/sys/kernel/perf_event_paranoid" << endl;
+
   if (total_failures)
   {
     if (!selected)
       _print_centered_header("SUMMARY OF %d FAILED TEST%s", failed_tests,
                              (failed_tests > 1) ? "S" : "");
 
-    for (string &test : to_run)
-      if (all_tests->at(test).failures.size())
-      {
-        if (!selected)
-          cout << test << ":" << endl;
+    if (spill)
+    {
+      // Reports were written out as tests finished
+      char buf[4096];
+      size_t len;
 
-        for (auto &f : all_tests->at(test).failures)
-          cout << "    " << f.str() << endl;
-      }
+      rewind(spill);
+
+      while ((len = fread(buf, 1, sizeof(buf), spill)) > 0)
+        cout.write(buf, len);
+
+      cout.flush();
+    }
+
+    for (string &test : to_run)
+      if (!spill && all_tests->at(test).failures.size())
+        _print_failures(cout, all_tests->at(test), selected);
   }
   else
   {
@@ -322,6 +966,9 @@ int mtest_main(int argc, char **argv)
       _print_centered_header("ALL TESTS PASSED");
   }
 
+  if (trace_enabled && !_trace_write())
+    cerr << "ERROR: couldn't write trace to " << trace_path << endl;
+
   _cleanup();
   return total_failures ? -1 : 0;
 }
@@ -336,11 +983,298 @@ int _mtest_push(const char* name, void (*tfun)(void*))
   return all_tests->size();
 }
 
-std::ostream& _mtest_fail(void *self)
+int _mtest_push_fuzz(const char* name, void (*ffun)(void*, const uint8_t*, size_t))
+{
+  if (!all_tests)
+    all_tests = new map<string, Test>();
+
+  Test test(_fuzz_replay, name);
+  test.ffun = ffun;
+  all_tests->emplace(make_pair(name, test));
+
+  return all_tests->size();
+}
+
+int _mtest_push_async(const char* name, void (*tstart)(void*))
+{
+  if (!all_tests)
+    all_tests = new map<string, Test>();
+
+  all_tests->emplace(make_pair(name, Test(tstart, name, true)));
+
+  return all_tests->size();
+}
+
+void _mtest_fail_cond(void *self, const char *file, int line, bool assertion,
+                      const char *cond)
+{
+  stringstream ss;
+
+  ss << "[" << file << ":" << line << "] "
+     << "failed " << (assertion ? "assertion" : "expectation")
+     << " \"" << cond << "\"";
+
+  if (assertion)
+    ss << ", aborting test";
+
+  _add_failure(self, ss.str());
+}
+
+void _mtest_fail_op(void *self, const char *file, int line, bool assertion,
+                    const char *lhs, const char *op, const char *rhs,
+                    _mtest_value lval, _mtest_value rval)
+{
+  stringstream ss;
+
+  if (assertion)
+    ss << "[" << file << ":" << line << "] failed assertion \"";
+  else
+    ss << file << ":" << line << " | failed expectation \"";
+
+  ss << lhs << " " << op << " " << rhs << "\": \"";
+  lval.print(ss, lval.ptr);
+  ss << "\" !" << op << " \"";
+  rval.print(ss, rval.ptr);
+  ss << "\"";
+
+  if (assertion)
+    ss << ", aborting test";
+
+  _add_failure(self, ss.str());
+}
+
+bool _mtest_mem_eq(void *self, const char *file, int line, bool assertion,
+                   const char *lhs, const char *rhs,
+                   const void *lbuf, const void *rbuf, size_t len)
+{
+  size_t first;
+  size_t mismatches = _mtest_mem_mismatches(lbuf, rbuf, len, 1, &first);
+
+  if (!mismatches)
+    return true;
+
+  stringstream ss;
+
+  _fail_header(ss, file, line, assertion, lhs, "==", rhs);
+  ss << " (" << len << " bytes): " << mismatches << " bytes differ, first at offset 0x"
+     << hex << first;
+
+  if (assertion)
+    ss << ", aborting test";
+
+  _hex_window(ss, "lhs", (const unsigned char *)lbuf, len,
+              "rhs", (const unsigned char *)rbuf, len, first);
+  _add_failure(self, ss.str());
+  return false;
+}
+
+_mtest_bytes _mtest_to_bytes(const char *str)
+{
+  _mtest_bytes b = { str, strlen(str) };
+  return b;
+}
+
+bool _mtest_golden(void *self, const char *file, int line, bool assertion,
+                   const char *expr, _mtest_bytes data, const char *path)
+{
+  // Cached results stay valid only while the golden files are unchanged
+  {
+    lock_guard<mutex> lock(golden_mutex);
+    vector<string> &goldens = ((Test *)self)->goldens;
+
+    if (find(goldens.begin(), goldens.end(), path) == goldens.end())
+      goldens.push_back(path);
+  }
+
+  MappedFile golden;
+  bool found = _map_file(path, &golden);
+  size_t golden_size = golden.size;
+  size_t common = golden.size < data.size ? golden.size : data.size;
+  size_t first = common;
+
+  // Scan the common prefix even when the sizes differ, so a truncated or
+  // extended output still points at where it starts to go wrong
+  bool differ = found && _mtest_mem_mismatches(golden.data, data.data, common, 1, &first);
+
+  if (found && !differ && golden.size == data.size)
+  {
+    _unmap_file(&golden);
+    return true;
+  }
+
+  // The mapping must be gone before the file can be replaced on Windows
+  stringstream ss;
+  if (found)
+    _hex_window(ss, "golden", (const unsigned char *)golden.data, golden.size,
+                "actual", (const unsigned char *)data.data, data.size, first);
+  string window = ss.str();
+  _unmap_file(&golden);
+
+  lock_guard<mutex> lock(golden_mutex);
+  string actual = string(path) + ".actual";
+
+  if (golden_update)
+  {
+    if (_replace_file(path, data.data, data.size))
+    {
+      remove(actual.c_str());
+      ++golden_updated;
+      return true;
+    }
+
+    ss.str("");
+    ss << "[" << file << ":" << line << "] failed to update golden file \""
+       << path << "\"";
+    _add_failure(self, ss.str());
+    return false;
+  }
+
+  bool wrote = _write_file(actual, data.data, data.size);
+
+  ss.str("");
+  ss << "[" << file << ":" << line << "] "
+     << "failed " << (assertion ? "assertion" : "expectation")
+     << " \"" << expr << "\" matches golden \"" << path << "\": ";
+
+  if (!found)
+    ss << "golden file not found";
+  else if (golden_size != data.size)
+    ss << "sizes differ (" << golden_size << " != " << data.size << " bytes)";
+  else
+    ss << "contents differ";
+
+  if (found)
+    ss << ", first difference at offset 0x" << hex << first << dec;
+
+  if (wrote)
+    ss << ", wrote " << actual;
+
+  if (assertion)
+    ss << ", aborting test";
+
+  _add_failure(self, ss.str() + window);
+  return false;
+}
+
+bool _mtest_near_all(void *self, const char *file, int line, bool assertion,
+                     const char *lhs, const char *rhs,
+                     const float *lbuf, const float *rbuf, size_t count,
+                     double tol, bool ulp)
+{
+  return _near_all(self, file, line, assertion, lhs, rhs, lbuf, rbuf, count, tol, ulp);
+}
+
+bool _mtest_near_all(void *self, const char *file, int line, bool assertion,
+                     const char *lhs, const char *rhs,
+                     const double *lbuf, const double *rbuf, size_t count,
+                     double tol, bool ulp)
+{
+  return _near_all(self, file, line, assertion, lhs, rhs, lbuf, rbuf, count, tol, ulp);
+}
+
+void _mtest_fail_range(void *self, const char *file, int line, bool assertion,
+                       const char *lhs, const char *rhs, size_t lcount,
+                       size_t rcount, size_t mismatches, size_t first,
+                       _mtest_value lval, _mtest_value rval)
+{
+  stringstream ss;
+
+  _fail_header(ss, file, line, assertion, lhs, "==", rhs);
+  ss << ":";
+
+  if (lcount != rcount)
+    ss << " sizes differ (" << lcount << " != " << rcount << ")" << (mismatches ? "," : "");
+
+  if (mismatches)
+  {
+    ss << " " << mismatches << " of " << (lcount < rcount ? lcount : rcount)
+       << " elements differ, first at index " << first << ": \"";
+    lval.print(ss, lval.ptr);
+    ss << "\" != \"";
+    rval.print(ss, rval.ptr);
+    ss << "\"";
+  }
+
+  if (assertion)
+    ss << ", aborting test";
+
+  _add_failure(self, ss.str());
+}
+
+size_t _mtest_mem_mismatches(const void *lbuf, const void *rbuf, size_t count,
+                             size_t elem, size_t *first)
+{
+  const unsigned char *a = (const unsigned char *)lbuf;
+  const unsigned char *b = (const unsigned char *)rbuf;
+  size_t len = count * elem;
+  size_t pos = 0;
+  size_t mismatches = 0;
+
+  *first = count;
+
+  // Vector kernels handle whole blocks, the scalar loop finishes the tail
+  if (elem == 1 || elem == 2 || elem == 4 || elem == 8)
+  {
+#ifdef MTEST_AVX2
+    if (__builtin_cpu_supports("avx2"))
+      pos = _mem_scan_avx2(a, b, len, elem, first, &mismatches);
+#endif
+#ifdef MTEST_SSE2
+    if (!pos)
+      pos = _mem_scan_sse2(a, b, len, elem, first, &mismatches);
+#endif
+  }
+
+  for (size_t i = pos / elem; i < count; ++i)
+    if (memcmp(a + i * elem, b + i * elem, elem) && !mismatches++)
+      *first = i;
+
+  return mismatches;
+}
+
+#define MT_DEFINE_PRINTER(T)                                                   \
+  void _mtest_printer<T>::print(std::ostream &os, const void *ptr)             \
+  {                                                                            \
+    typedef T type;                                                            \
+    os << *(const type *)ptr;                                                  \
+  }
+
+MT_DEFINE_PRINTER(bool)
+MT_DEFINE_PRINTER(char)
+MT_DEFINE_PRINTER(signed char)
+MT_DEFINE_PRINTER(unsigned char)
+MT_DEFINE_PRINTER(short)
+MT_DEFINE_PRINTER(unsigned short)
+MT_DEFINE_PRINTER(int)
+MT_DEFINE_PRINTER(unsigned int)
+MT_DEFINE_PRINTER(long)
+MT_DEFINE_PRINTER(unsigned long)
+MT_DEFINE_PRINTER(long long)
+MT_DEFINE_PRINTER(unsigned long long)
+MT_DEFINE_PRINTER(float)
+MT_DEFINE_PRINTER(double)
+MT_DEFINE_PRINTER(long double)
+MT_DEFINE_PRINTER(char *)
+MT_DEFINE_PRINTER(const char *)
+
+void _mtest_printer<std::nullptr_t>::print(std::ostream &os, const void *)
+{
+  os << "nullptr";
+}
+
+void _mtest_print_ptr(std::ostream &os, const void *ptr)
+{
+  os << ptr;
+}
+
+void _mtest_print_chars(std::ostream &os, const void *ptr)
+{
+  os << (const char *)ptr;
+}
+
+void _mtest_print_buf(std::ostream &os, const char *buf, size_t len)
 {
-  Test *tstruct = (Test *)self;
-  tstruct->failures.push_back(stringstream());
-  return tstruct->failures.back();
+  os.write(buf, len);
 }
 
 int _get_terminal_width()
@@ -352,7 +1286,7 @@ int _get_terminal_width()
 #else
   if (!isatty(fileno(stdout))) return 80;
   struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) || !w.ws_col) return 80;
   return w.ws_col;
 #endif
 }
@@ -451,8 +1385,35 @@ void mtest_thread_main(void *ud)
 {
   Thread* self = (Thread*) ud;
 
+  // Counters are scoped to this thread, so each worker opens its own.
+  int perf_fds[PERF_EVENTS];
+  bool perf_software = false;
+  bool perf_ok = perf_enabled && _perf_open(perf_fds, &perf_software);
+
+  if (perf_ok)
+  {
+    perf_local = perf_fds;
+    perf_local_software = perf_software;
+  }
+  else if (perf_enabled)
+    perf_unavailable = true;
+
+  if (trace_enabled)
+    _trace_register("worker " + to_string(self->index));
+
+  pool_worker = self;
+
   while (1)
   {
+    // Subtasks of running tests come first
+    Task task;
+
+    if (_pool_take(&task))
+    {
+      _pool_run(task);
+      continue;
+    }
+
     string target;
     int creq = self->get_req(&target);
 
@@ -461,54 +1422,162 @@ void mtest_thread_main(void *ud)
 
     if (creq == -1)
     {
-      _wait(BWAIT);
+      unique_lock<mutex> lock(pool_mutex);
+      pool_cv.wait(lock, [self] { return pool_queued > 0 || self->get_req() != -1; });
       continue;
     }
 
+    Test &test = all_tests->at(target);
+
+    // Fuzz tests replay their corpus, which the cache key doesn't cover
+    bool cacheable = cache_dir.size() && !test.ffun;
+    bool cached = cacheable && !golden_update && _cache_lookup(test.name);
+
     // Run test!
+    if (perf_ok && !cached)
+    {
+      memset(perf_foreign, 0, sizeof(perf_foreign));
+      _perf_start(perf_fds);
+    }
+
+    long long trace_start = _mtest_trace_now();
+    chrono::steady_clock::time_point wall_start = chrono::steady_clock::now();
     clock_t start_time = clock();
-    all_tests->at(target).tfun(&all_tests->at(target));
+    current_test = &test;
+    if (!cached)
+      test.tfun(&test);
+    current_test = nullptr;
     clock_t end_time = clock();
 
-    // Acquire output mutex
-    out_mutex.lock();
-    _clear_row();
+    if (!cached)
+      test.wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - wall_start).count();
 
-    if (!self->quiet)
+    _trace_span(test.name, cached ? "cached" : "test", trace_start, &test);
+
+    if (perf_ok && !cached)
     {
-      cout
-        << "    " << setw((int)log10(all_tests->size()) + 1) << ++total_tested
-        << " / " << total_to_run
-        << "    " << setw(max_testlen) << all_tests->at(target).name
-        << " ... ";
+      Counters own;
+      _perf_stop(perf_fds, &own);
 
-      if (all_tests->at(target).failures.size())
-      {
-        _set_color(RED);
-        cout << "FAILED ";
-        _set_color(RESET);
-
-        ++failed_tests;
-      } else {
-        _set_color(GREEN);
-        cout << "OK     ";
-        _set_color(RESET);
-      }
+      // Tasks of other tests run while waiting count towards their owners
+      for (int i = 0; i < PERF_EVENTS; ++i)
+        own.values[i] -= min(own.values[i], perf_foreign[i]);
 
-      cout << "( " << (end_time - start_time) / (CLOCKS_PER_SEC / 1000) << " ms )" << endl;
+      _perf_add(&test, own, perf_software);
     }
 
-    total_failures += all_tests->at(target).failures.size();
-    out_mutex.unlock();
+    if (!cached && cacheable && !test.failures.size())
+      _cache_store(test);
+
+    _finish_test(test, self->quiet, cached, (end_time - start_time) / (CLOCKS_PER_SEC / 1000));
 
     self->set_req(-1);
+    _pool_notify();
+  }
+
+  if (perf_ok)
+  {
+    perf_local = nullptr;
+    _perf_close(perf_fds);
+  }
+}
+
+void _finish_test(Test &test, bool quiet, bool cached, long ms)
+{
+  long long lock_start = _mtest_trace_now();
+
+  // Acquire output mutex
+  out_mutex.lock();
+  _trace_span("wait for output", "output", lock_start);
+  _clear_row();
+
+  if (!quiet)
+  {
+    cout
+      << "    " << setw((int)log10(all_tests->size()) + 1) << ++total_tested
+      << " / " << total_to_run
+      << "    " << setw(max_testlen) << test.name
+      << " ... ";
+
+    if (test.failures.size())
+    {
+      _set_color(RED);
+      cout << "FAILED ";
+      _set_color(RESET);
+    } else if (cached) {
+      _set_color(BLUE);
+      cout << "CACHED ";
+      _set_color(RESET);
+    } else {
+      _set_color(GREEN);
+      cout << "OK     ";
+      _set_color(RESET);
+    }
+
+    if (cached)
+      cout << "( cached OK )";
+    else
+      cout << "( " << ms << " ms )";
+
+    if (test.counters.valid)
+      cout << " [ " << _perf_format(test.counters) << " ]";
+
+    cout << endl;
+  }
+
+  if (test.counters.valid)
+  {
+    Counters &total = perf_totals[test.counters.software];
+
+    total.valid = true;
+    total.software = test.counters.software;
+
+    for (int i = 0; i < PERF_EVENTS; ++i)
+      total.values[i] += test.counters.values[i];
+  }
+
+  if (test.failures.size())
+    ++failed_tests;
+
+  if (cached)
+    ++total_cached;
+
+  test.ran = true;
+  test.failed = test.failures.size();
+  total_failures += test.failures.size();
+
+  // Streaming runs spill the report and release the test's state
+  if (spill && test.failed)
+  {
+    stringstream ss;
+    _print_failures(ss, test, quiet);
+
+    string report = ss.str();
+    fwrite(report.data(), 1, report.size(), spill);
+    vector<string>().swap(test.failures);
   }
+
+  // Logs are only kept for the failure summary
+  if (spill || !test.failed)
+  {
+    delete test.log;
+    test.log = nullptr;
+  }
+  else if (test.log)
+    test.log->data.shrink_to_fit();
+
+  out_mutex.unlock();
 }
 
 void mtest_status_main() {
   int done = 0;
+  if (trace_enabled)
+    _trace_register("status");
+
   while (!done)
   {
+    long long trace_start = _mtest_trace_now();
+
     done = 1;
     out_mutex.lock();
     _clear_row();
@@ -536,6 +1605,8 @@ void mtest_status_main() {
     cout << "]";
     cout.flush();
     out_mutex.unlock();
+
+    _trace_span("status", "output", trace_start);
     _wait(STATUS_WAIT);
   }
 }
@@ -555,8 +1626,25 @@ void _clear_row()
 
 void _cleanup()
 {
+  if (log_capture)
+  {
+    cout.rdbuf(capture_out->orig);
+    cerr.rdbuf(capture_err->orig);
+    delete capture_out;
+    delete capture_err;
+  }
+
+  for (auto &it : *all_tests)
+    delete it.second.log;
+
+  if (spill)
+    fclose(spill);
+
   delete all_tests;
 
+  for (auto &b : trace_buffers)
+    delete b;
+
   for (auto& t : threads)
     delete t;
 }
@@ -565,3 +1653,2323 @@ void _wait(int ms)
 {
   this_thread::sleep_for(chrono::milliseconds(ms));
 }
+
+uint64_t _hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  // 64-bit FNV-1a
+  const unsigned char *p = (const unsigned char *)data;
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+bool _hash_file(uint64_t *h, const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+
+  if (!fp)
+    return false;
+
+  char buf[65536];
+  size_t len;
+
+  *h = _hash_bytes(*h, path, strlen(path));
+
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    *h = _hash_bytes(*h, buf, len);
+
+  fclose(fp);
+  return true;
+}
+
+bool _hash_binary(uint64_t *h)
+{
+  *h = 0xcbf29ce484222325ULL;
+
+#if defined(_WIN32)
+  char path[MAX_PATH];
+  DWORD len = GetModuleFileNameA(NULL, path, sizeof(path));
+
+  if (!len || len >= sizeof(path))
+    return false;
+
+  return _hash_file(h, path);
+#elif defined(__linux__)
+  // Hash every executable mapping, so that tests loaded from shared
+  // libraries invalidate the cache when the library changes.
+  FILE *maps = fopen("/proc/self/maps", "r");
+
+  if (!maps)
+    return false;
+
+  vector<string> objects;
+  char line[4096];
+
+  while (fgets(line, sizeof(line), maps))
+  {
+    char perms[8];
+    int path_ofs = 0;
+
+    if (sscanf(line, "%*s %7s %*s %*s %*s %n", perms, &path_ofs) < 1)
+      continue;
+
+    if (perms[2] != 'x' || line[path_ofs] != '/')
+      continue;
+
+    string path(line + path_ofs);
+
+    while (path.size() && isspace((unsigned char)path.back()))
+      path.pop_back();
+
+    bool seen = false;
+
+    for (auto &o : objects)
+      if (o == path)
+        seen = true;
+
+    if (!seen)
+      objects.push_back(path);
+  }
+
+  fclose(maps);
+
+  if (!objects.size())
+    return false;
+
+  // Mapping order varies with ASLR, so hash in a fixed order
+  sort(objects.begin(), objects.end());
+
+  for (auto &o : objects)
+    if (!_hash_file(h, o.c_str()))
+      return false;
+
+  return true;
+#elif defined(__APPLE__)
+  char path[4096];
+  uint32_t len = sizeof(path);
+
+  if (_NSGetExecutablePath(path, &len))
+    return false;
+
+  return _hash_file(h, path);
+#else
+  return false;
+#endif
+}
+
+uint64_t _hash_env(uint64_t h)
+{
+  char *names = getenv("MTEST_CACHE_ENV");
+
+  if (!names)
+    return h;
+
+  stringstream ss(names);
+  string name;
+
+  while (getline(ss, name, ','))
+  {
+    char *val = getenv(name.c_str());
+
+    h = _hash_bytes(h, name.c_str(), name.size() + 1);
+
+    if (val)
+      h = _hash_bytes(h, val, strlen(val) + 1);
+  }
+
+  return h;
+}
+
+string _cache_path(const char *name)
+{
+  char key[17];
+  uint64_t h = _hash_bytes(cache_base, name, strlen(name));
+
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+  return cache_dir + "/" + key;
+}
+
+bool _cache_lookup(const char *name)
+{
+  FILE *fp = fopen(_cache_path(name).c_str(), "r");
+
+  if (!fp)
+    return false;
+
+  char line[4096];
+  char expect[4096];
+  bool hit = false;
+
+  snprintf(expect, sizeof(expect), "%016llx %s\n", (unsigned long long)cache_base, name);
+
+  if (fgets(line, sizeof(line), fp))
+    hit = !strcmp(line, expect);
+
+  // Every golden file the test compared must still hash the same
+  while (hit && fgets(line, sizeof(line), fp))
+  {
+    unsigned long long recorded;
+    int path_ofs = 0;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    if (sscanf(line, "%16llx %n", &recorded, &path_ofs) < 1 || !path_ofs)
+    {
+      hit = false;
+      break;
+    }
+
+    string path(line + path_ofs);
+
+    if (path.size() && path.back() == '\n')
+      path.pop_back();
+
+    hit = _hash_file(&h, path.c_str()) && h == recorded;
+  }
+
+  fclose(fp);
+  return hit;
+}
+
+void _cache_store(Test &test)
+{
+  char hash[17];
+
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)cache_base);
+  string record = string(hash) + " " + test.name + "\n";
+
+  for (auto &path : test.goldens)
+  {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    // A golden file which can't be hashed can't be checked on lookup either
+    if (!_hash_file(&h, path.c_str()))
+      return;
+
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)h);
+    record += string(hash) + " " + path + "\n";
+  }
+
+  // Replaced atomically, as other runs may share the cache directory
+  _make_dir(cache_dir);
+  _replace_file(_cache_path(test.name).c_str(), record.data(), record.size());
+}
+
+int _cache_prune()
+{
+  char base[17];
+  int removed = 0;
+  vector<string> entries;
+
+  snprintf(base, sizeof(base), "%016llx", (unsigned long long)cache_base);
+
+  if (!_list_dir(cache_dir, &entries))
+    return 0;
+
+  for (auto &e : entries)
+  {
+    string path = cache_dir + "/" + e;
+
+    // Temporary files left behind by runs which were killed while storing
+    if (e.size() > 20 && !e.compare(16, 4, ".tmp")
+        && e.find_first_not_of("0123456789abcdef") == 16)
+    {
+      if (!remove(path.c_str()))
+        ++removed;
+
+      continue;
+    }
+
+    if (e.size() != 16 || e.find_first_not_of("0123456789abcdef") != string::npos)
+      continue;
+
+    FILE *fp = fopen(path.c_str(), "r");
+
+    if (!fp)
+      continue;
+
+    char line[4096];
+    bool stale = !fgets(line, sizeof(line), fp) || strncmp(line, base, 16);
+
+    fclose(fp);
+
+    if (stale && !remove(path.c_str()))
+      ++removed;
+  }
+
+  return removed;
+}
+
+bool _perf_open(int *fds, bool *software)
+{
+#ifdef __linux__
+  static const uint32_t types[2] = { PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE };
+  static const uint64_t configs[2][PERF_EVENTS] = {
+    { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES,
+      PERF_COUNT_SW_PAGE_FAULTS, PERF_COUNT_SW_CPU_MIGRATIONS },
+  };
+
+  // Hardware events are often unavailable in containers and VMs, fall back
+  // to the software events the kernel can always provide.
+  for (int set = 0; set < 2; ++set)
+  {
+    int opened = 0;
+
+    for (; opened < PERF_EVENTS; ++opened)
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+
+      attr.size = sizeof(attr);
+      attr.type = types[set];
+      attr.config = configs[set][opened];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      fds[opened] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+      if (fds[opened] < 0)
+        break;
+    }
+
+    if (opened == PERF_EVENTS)
+    {
+      *software = set == 1;
+      return true;
+    }
+
+    while (opened--)
+      close(fds[opened]);
+  }
+#endif
+
+  return false;
+}
+
+void _perf_close(int *fds)
+{
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENTS; ++i)
+    close(fds[i]);
+#endif
+}
+
+void _perf_start(int *fds)
+{
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENTS; ++i)
+  {
+    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+void _perf_stop(int *fds, Counters *out)
+{
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENTS; ++i)
+    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+  out->valid = _perf_read(fds, out->values);
+#endif
+}
+
+bool _perf_read(int *fds, uint64_t *values)
+{
+#ifdef __linux__
+  for (int i = 0; i < PERF_EVENTS; ++i)
+  {
+    uint64_t data[3]; // value, time enabled, time running
+
+    if (read(fds[i], data, sizeof(data)) != sizeof(data))
+      return false;
+
+    // Scale up if the event was multiplexed with others
+    if (data[2] && data[2] < data[1])
+      data[0] = (uint64_t)((double)data[0] * data[1] / data[2]);
+
+    values[i] = data[0];
+  }
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+void _perf_add(Test *test, const Counters &c, bool software)
+{
+  if (!c.valid)
+    return;
+
+  lock_guard<mutex> lock(perf_mutex);
+
+  test->counters.valid = true;
+  test->counters.software = software;
+
+  for (int i = 0; i < PERF_EVENTS; ++i)
+    test->counters.values[i] += c.values[i];
+}
+
+string _perf_count(double val)
+{
+  static const char *suffixes[] = { "", "k", "M", "G", "T" };
+  int s = 0;
+  char buf[32];
+
+  while (val >= 1000.0 && s < 4)
+  {
+    val /= 1000.0;
+    ++s;
+  }
+
+  snprintf(buf, sizeof(buf), s ? "%.1f%s" : "%.0f%s", val, suffixes[s]);
+  return buf;
+}
+
+string _perf_format(const Counters &c)
+{
+  stringstream ss;
+
+  if (c.software)
+  {
+    ss << fixed << setprecision(1) << c.values[0] / 1e6 << " ms task, "
+       << _perf_count(c.values[1]) << " ctx-sw, "
+       << _perf_count(c.values[2]) << " faults, "
+       << _perf_count(c.values[3]) << " migrations";
+  }
+  else
+  {
+    double ipc = c.values[0] ? (double)c.values[1] / c.values[0] : 0.0;
+
+    ss << _perf_count(c.values[0]) << " cycles, "
+       << _perf_count(c.values[1]) << " instr, "
+       << fixed << setprecision(2) << ipc << " IPC, "
+       << _perf_count(c.values[2]) << " cache-miss, "
+       << _perf_count(c.values[3]) << " branch-miss";
+  }
+
+  return ss.str();
+}
+
+#ifdef __linux__
+void mtest_async_main(void *ud)
+{
+  AsyncLoop *loop = (AsyncLoop *)ud;
+
+  if (trace_enabled)
+    _trace_register("event loop");
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = loop->wakefd;
+  epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+
+  while (1)
+  {
+    vector<Test*> starting;
+    bool closing;
+
+    {
+      lock_guard<mutex> lock(loop->mut);
+      starting.swap(loop->pending);
+      closing = loop->closing;
+    }
+
+    // Start new tests, they run until their first co_await
+    for (auto &test : starting)
+    {
+      if (cache_dir.size() && !golden_update && _cache_lookup(test->name))
+      {
+        _finish_test(*test, loop->quiet, true, 0);
+        continue;
+      }
+
+      auto now = chrono::steady_clock::now();
+
+      ++loop->running;
+      loop->started[test] = now;
+
+      if (async_timeout > 0)
+        loop->deadlines.insert(make_pair(now + chrono::microseconds(
+          (long long)(async_timeout * 1e6)), test));
+
+      current_test = test;
+      test->tfun(test);
+      current_test = nullptr;
+    }
+
+    if (closing && !loop->running)
+      break;
+
+    int timeout = -1;
+
+    if (loop->timers.size() || loop->deadlines.size())
+    {
+      auto next = loop->timers.size() ? loop->timers.begin()->first
+                                      : loop->deadlines.begin()->first;
+
+      if (loop->deadlines.size() && loop->deadlines.begin()->first < next)
+        next = loop->deadlines.begin()->first;
+
+      auto wait = next - chrono::steady_clock::now();
+      timeout = (int)chrono::duration_cast<chrono::milliseconds>(wait).count() + 1;
+
+      if (timeout < 0)
+        timeout = 0;
+    }
+
+    struct epoll_event events[64];
+    int count = epoll_wait(loop->epfd, events, 64, timeout);
+
+    for (int i = 0; i < count; ++i)
+    {
+      if (events[i].data.fd == loop->wakefd)
+      {
+        uint64_t val;
+        if (read(loop->wakefd, &val, sizeof(val))) {}
+        continue;
+      }
+
+      _async_ready(loop, events[i].data.fd, events[i].events);
+    }
+
+    // Resume expired timers
+    auto now = chrono::steady_clock::now();
+
+    while (loop->timers.size() && loop->timers.begin()->first <= now)
+    {
+      Waiter w = loop->timers.begin()->second;
+      loop->timers.erase(loop->timers.begin());
+      _async_resume(w);
+    }
+
+    // Fail tests which ran out of time, entries of finished tests are stale
+    now = chrono::steady_clock::now();
+
+    while (loop->deadlines.size() && loop->deadlines.begin()->first <= now)
+    {
+      Test *test = loop->deadlines.begin()->second;
+      loop->deadlines.erase(loop->deadlines.begin());
+
+      if (loop->started.count(test))
+        _async_expire(loop, test);
+    }
+  }
+
+  close(loop->wakefd);
+  close(loop->epfd);
+}
+
+int _async_watch(AsyncLoop *loop, int fd, bool modify)
+{
+  struct epoll_event ev;
+  ev.events = 0;
+  ev.data.fd = fd;
+
+  for (auto &w : loop->fd_waiters[fd])
+    ev.events |= w.write ? EPOLLOUT : EPOLLIN;
+
+  return epoll_ctl(loop->epfd, modify ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) ? errno : 0;
+}
+
+void _async_ready(AsyncLoop *loop, int fd, uint32_t events)
+{
+  auto it = loop->fd_waiters.find(fd);
+
+  if (it == loop->fd_waiters.end())
+    return;
+
+  // Wake the oldest reader and writer only. Readiness is level-triggered,
+  // so others waiting on the descriptor get the next event.
+  bool readable = events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+  bool writable = events & (EPOLLOUT | EPOLLERR | EPOLLHUP);
+  vector<Waiter> ready, waiting;
+
+  for (auto &w : it->second)
+  {
+    bool &avail = w.write ? writable : readable;
+
+    if (avail)
+    {
+      ready.push_back(w);
+      avail = false;
+    }
+    else
+      waiting.push_back(w);
+  }
+
+  // Update the watch before resuming, as resumed tests may wait again
+  if (waiting.size())
+  {
+    it->second.swap(waiting);
+    _async_watch(loop, fd, true);
+  }
+  else
+  {
+    loop->fd_waiters.erase(it);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+  }
+
+  for (auto &w : ready)
+    _async_resume(w);
+}
+
+void _async_expire(AsyncLoop *loop, Test *test)
+{
+  stringstream ss;
+  Waiter w = Waiter();
+  bool found = false;
+
+  ss << "[async] timed out after " << async_timeout << " s";
+
+  for (auto it = loop->timers.begin(); !found && it != loop->timers.end(); ++it)
+    if (it->second.test == test)
+    {
+      w = it->second;
+      loop->timers.erase(it);
+      found = true;
+      ss << " while sleeping";
+      break;
+    }
+
+  for (auto it = loop->fd_waiters.begin(); !found && it != loop->fd_waiters.end(); ++it)
+  {
+    vector<Waiter> &waiters = it->second;
+
+    for (size_t i = 0; i < waiters.size(); ++i)
+      if (waiters[i].test == test)
+      {
+        w = waiters[i];
+        waiters.erase(waiters.begin() + i);
+        found = true;
+        ss << " waiting for descriptor " << w.fd << " to become "
+           << (w.write ? "writable" : "readable");
+        break;
+      }
+
+    if (found && waiters.size())
+      _async_watch(loop, w.fd, true);
+    else if (found)
+    {
+      loop->fd_waiters.erase(it);
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w.fd, NULL);
+    }
+
+    if (found)
+      break;
+  }
+
+  _add_failure(test, ss.str());
+
+  // Destroying the suspended coroutine runs the destructors of its locals
+  if (found)
+  {
+    current_test = test;
+    w.destroy(w.handle);
+  }
+
+  _mtest_async_done(test);
+}
+
+void _async_resume(Waiter &w)
+{
+  current_test = w.test;
+  w.resume(w.handle);
+  current_test = nullptr;
+}
+
+void _async_submit(Test *test, bool quiet)
+{
+  if (!async_loop)
+    async_loop = new AsyncLoop(quiet);
+
+  lock_guard<mutex> lock(async_loop->mut);
+  async_loop->pending.push_back(test);
+
+  uint64_t val = 1;
+  if (write(async_loop->wakefd, &val, sizeof(val))) {}
+}
+
+void _async_finish()
+{
+  if (!async_loop)
+    return;
+
+  {
+    lock_guard<mutex> lock(async_loop->mut);
+    async_loop->closing = true;
+
+    uint64_t val = 1;
+    if (write(async_loop->wakefd, &val, sizeof(val))) {}
+  }
+
+  async_loop->handle.join();
+  delete async_loop;
+  async_loop = NULL;
+}
+
+void _mtest_async_done(void *self)
+{
+  Test *test = (Test *)self;
+  auto elapsed = chrono::steady_clock::now() - async_loop->started[test];
+
+  // The test is over, don't capture the result line into its log
+  current_test = nullptr;
+  long ms = (long)chrono::duration_cast<chrono::milliseconds>(elapsed).count();
+
+  test->wall_ms = chrono::duration<double, milli>(elapsed).count();
+
+  if (cache_dir.size() && !test->failures.size())
+    _cache_store(*test);
+
+  _trace_span(test->name, "async", _trace_us(async_loop->started[test]), test);
+  _finish_test(*test, async_loop->quiet, false, ms);
+
+  async_loop->started.erase(test);
+  --async_loop->running;
+}
+
+void _mtest_async_sleep(void (*resume)(void*), void (*destroy)(void*), void *handle, int ms)
+{
+  Waiter w = { resume, destroy, handle, -1, current_test, false };
+  auto when = chrono::steady_clock::now() + chrono::milliseconds(ms);
+
+  async_loop->timers.insert(make_pair(when, w));
+}
+
+void _mtest_async_wait_fd(void (*resume)(void*), void (*destroy)(void*), void *handle,
+                          int fd, bool write)
+{
+  Waiter w = { resume, destroy, handle, fd, current_test, write };
+  vector<Waiter> &waiters = async_loop->fd_waiters[fd];
+  bool watched = waiters.size();
+
+  waiters.push_back(w);
+
+  int err = _async_watch(async_loop, fd, watched);
+
+  if (!err)
+    return;
+
+  waiters.pop_back();
+
+  if (!waiters.size())
+    async_loop->fd_waiters.erase(fd);
+
+  // Descriptors epoll can't watch (such as regular files) are always ready
+  if (err != EPERM)
+  {
+    stringstream ss;
+    ss << "[async] couldn't wait for descriptor " << fd << ": " << strerror(err);
+    _add_failure(current_test, ss.str());
+  }
+
+  _mtest_async_sleep(resume, destroy, handle, 0);
+}
+#else
+void _async_submit(Test *, bool) {}
+void _async_finish() {}
+#endif
+
+long long _mtest_trace_now()
+{
+  if (!trace_enabled)
+    return -1;
+
+  return _trace_us(chrono::steady_clock::now());
+}
+
+void _mtest_trace_span(const char *name, long long start)
+{
+  // Spans of asynchronous tests interleave on the event loop thread, so they
+  // are written out on a separate track for each test
+  bool async = current_test && current_test->async && !pool_worker;
+  _trace_span(name, "user", start, async ? current_test : nullptr);
+}
+
+void _trace_register(const string &name)
+{
+  lock_guard<mutex> lock(trace_mutex);
+
+  trace_local = new TraceBuffer(name, trace_buffers.size());
+  trace_buffers.push_back(trace_local);
+}
+
+long long _trace_us(chrono::steady_clock::time_point t)
+{
+  return chrono::duration_cast<chrono::microseconds>(t - trace_epoch).count();
+}
+
+void _trace_span(const char *name, const char *cat, long long start, const Test *test)
+{
+  if (start < 0)
+    return;
+
+  // Threads created by tests get a buffer on their first span
+  if (!trace_local)
+    _trace_register("thread");
+
+  TraceEvent ev = { name, cat, start, _mtest_trace_now() - start, test };
+  trace_local->events.push_back(ev);
+}
+
+void _trace_escape(FILE *fp, const char *str)
+{
+  for (; *str; ++str)
+  {
+    if (*str == '"' || *str == '\\')
+      fprintf(fp, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(fp, "\\u%04x", *str);
+    else
+      fputc(*str, fp);
+  }
+}
+
+void _trace_args(FILE *fp, const Counters &c)
+{
+  static const char *names[2][PERF_EVENTS] = {
+    { "cycles", "instructions", "cache_misses", "branch_misses" },
+    { "task_clock_ns", "context_switches", "page_faults", "migrations" },
+  };
+
+  fprintf(fp, ",\"args\":{");
+
+  for (int i = 0; i < PERF_EVENTS; ++i)
+    fprintf(fp, "%s\"%s\":%llu", i ? "," : "", names[c.software][i],
+            (unsigned long long)c.values[i]);
+
+  fprintf(fp, "}");
+}
+
+bool _trace_write()
+{
+  FILE *fp = fopen(trace_path.c_str(), "w");
+
+  if (!fp)
+    return false;
+
+  bool first = true;
+  map<const Test*, int> async_tids; // one track per asynchronous test
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  for (auto &b : trace_buffers)
+  {
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"", first ? "" : ",\n", b->tid);
+    _trace_escape(fp, b->name.c_str());
+    fprintf(fp, "\"}}");
+    first = false;
+
+    for (auto &ev : b->events)
+    {
+      int tid = b->tid;
+
+      // Asynchronous tests overlap on the event loop thread
+      if (ev.test && ev.test->async)
+      {
+        auto it = async_tids.find(ev.test);
+
+        if (it == async_tids.end())
+        {
+          int next = (int)(trace_buffers.size() + async_tids.size());
+          it = async_tids.insert(make_pair(ev.test, next)).first;
+
+          fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                  "\"args\":{\"name\":\"async ", next);
+          _trace_escape(fp, ev.test->name);
+          fprintf(fp, "\"}}");
+        }
+
+        tid = it->second;
+      }
+
+      fprintf(fp, ",\n{\"name\":\"");
+      _trace_escape(fp, ev.name);
+      fprintf(fp, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+              "\"pid\":1,\"tid\":%d", ev.cat, ev.ts, ev.dur, tid);
+
+      // Counters from --mtest-perf go with the span of the test body
+      if (ev.test && ev.name == ev.test->name && ev.test->counters.valid)
+        _trace_args(fp, ev.test->counters);
+
+      fprintf(fp, "}");
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  return !fclose(fp);
+}
+
+void _add_failure(void *self, const string &msg)
+{
+  lock_guard<mutex> lock(failure_mutex);
+  ((Test *)self)->failures.push_back(msg);
+}
+
+void *_mtest_group_create()
+{
+  return new TaskGroup();
+}
+
+void _mtest_group_destroy(void *group)
+{
+  _mtest_group_wait(group);
+  delete (TaskGroup *)group;
+}
+
+void _mtest_group_run(void *group, void (*fn)(void*), void *arg)
+{
+  Task task = { fn, arg, (TaskGroup *)group, current_test };
+
+  ++task.group->pending;
+
+  if (pool_worker)
+  {
+    lock_guard<mutex> lock(pool_worker->mut);
+    pool_worker->tasks.push_back(task);
+  }
+  else
+  {
+    lock_guard<mutex> lock(pool_mutex);
+    pool_inject.push_back(task);
+  }
+
+  ++pool_queued;
+  _pool_notify();
+}
+
+void _mtest_group_wait(void *group)
+{
+  TaskGroup *tg = (TaskGroup *)group;
+
+  // Run queued tasks instead of sleeping until the group is done
+  while (tg->pending > 0)
+  {
+    Task task;
+
+    if (_pool_take(&task))
+    {
+      _pool_run(task);
+      continue;
+    }
+
+    unique_lock<mutex> lock(pool_mutex);
+    pool_cv.wait(lock, [tg] { return tg->pending == 0 || pool_queued > 0; });
+  }
+}
+
+size_t _mtest_pool_chunks(size_t count)
+{
+  // A few chunks per worker leaves room for stealing when chunks are uneven
+  size_t chunks = 4 * (threads.size() ? threads.size() : 1);
+  return count < chunks ? count : chunks;
+}
+
+void _fail_header(stringstream &ss, const char *file, int line, bool assertion,
+                  const char *lhs, const char *op, const char *rhs)
+{
+  ss << "[" << file << ":" << line << "] "
+     << "failed " << (assertion ? "assertion" : "expectation")
+     << " \"" << lhs << " " << op << " " << rhs << "\"";
+}
+
+int _popcount32(uint32_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(val);
+#else
+  int count = 0;
+  for (; val; val &= val - 1)
+    ++count;
+  return count;
+#endif
+}
+
+int _ctz32(uint32_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(val);
+#elif defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward(&idx, val);
+  return (int)idx;
+#else
+  int idx = 0;
+  for (; !(val & 1); val >>= 1)
+    ++idx;
+  return idx;
+#endif
+}
+
+uint32_t _fold_mask(uint32_t diff, size_t elem)
+{
+  // diff holds one bit per differing byte, reduce it to one bit per element
+  switch (elem)
+  {
+  case 2:
+    diff = (diff | diff >> 1) & 0x55555555;
+    break;
+  case 4:
+    diff |= diff >> 1;
+    diff = (diff | diff >> 2) & 0x11111111;
+    break;
+  case 8:
+    diff |= diff >> 1;
+    diff |= diff >> 2;
+    diff = (diff | diff >> 4) & 0x01010101;
+    break;
+  }
+
+  return diff;
+}
+
+#ifdef MTEST_SSE2
+size_t _mem_scan_sse2(const unsigned char *a, const unsigned char *b, size_t len,
+                      size_t elem, size_t *first, size_t *mismatches)
+{
+  size_t pos = 0;
+
+  for (; pos + 16 <= len; pos += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + pos));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + pos));
+    uint32_t diff = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+
+    if (diff)
+    {
+      diff = _fold_mask(diff, elem);
+
+      if (!*mismatches)
+        *first = (pos + _ctz32(diff)) / elem;
+
+      *mismatches += _popcount32(diff);
+    }
+  }
+
+  return pos;
+}
+#endif
+
+#ifdef MTEST_AVX2
+__attribute__((target("avx2")))
+size_t _mem_scan_avx2(const unsigned char *a, const unsigned char *b, size_t len,
+                      size_t elem, size_t *first, size_t *mismatches)
+{
+  size_t pos = 0;
+
+  for (; pos + 32 <= len; pos += 32)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + pos));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + pos));
+    uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+    if (diff)
+    {
+      diff = _fold_mask(diff, elem);
+
+      if (!*mismatches)
+        *first = (pos + _ctz32(diff)) / elem;
+
+      *mismatches += _popcount32(diff);
+    }
+  }
+
+  return pos;
+}
+#endif
+
+// Maps floats onto unsigned integers which order the same way, so the
+// distance between two mapped values is their distance in ULPs.
+static uint64_t _ordered(float val)
+{
+  uint32_t u;
+  memcpy(&u, &val, sizeof(u));
+  return (u & 0x80000000u) ? (uint32_t)~u : (u | 0x80000000u);
+}
+
+static uint64_t _ordered(double val)
+{
+  uint64_t u;
+  memcpy(&u, &val, sizeof(u));
+  return (u & 0x8000000000000000ULL) ? ~u : (u | 0x8000000000000000ULL);
+}
+
+template <typename T>
+static bool _near_scalar(T a, T b, double tol, bool ulp)
+{
+  if (a == b)
+    return true;
+
+  if (ulp)
+  {
+    if (a != a || b != b)
+      return false;
+
+    uint64_t oa = _ordered(a), ob = _ordered(b);
+    return (double)(oa > ob ? oa - ob : ob - oa) <= tol;
+  }
+
+  T diff = a > b ? a - b : b - a;
+  return diff <= (T)tol;
+}
+
+#ifdef MTEST_SSE2
+static size_t _near_scan_sse2(const float *a, const float *b, size_t count, double tol,
+                              size_t *first, size_t *mismatches)
+{
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  const __m128 vtol = _mm_set1_ps((float)tol);
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 va = _mm_loadu_ps(a + i), vb = _mm_loadu_ps(b + i);
+    __m128 diff = _mm_andnot_ps(sign, _mm_sub_ps(va, vb));
+    __m128 ok = _mm_or_ps(_mm_cmpeq_ps(va, vb), _mm_cmple_ps(diff, vtol));
+    uint32_t bad = ~(uint32_t)_mm_movemask_ps(ok) & 0xf;
+
+    if (bad)
+    {
+      if (!*mismatches)
+        *first = i + _ctz32(bad);
+
+      *mismatches += _popcount32(bad);
+    }
+  }
+
+  return i;
+}
+
+static size_t _near_scan_sse2(const double *a, const double *b, size_t count, double tol,
+                              size_t *first, size_t *mismatches)
+{
+  const __m128d sign = _mm_set1_pd(-0.0);
+  const __m128d vtol = _mm_set1_pd(tol);
+  size_t i = 0;
+
+  for (; i + 2 <= count; i += 2)
+  {
+    __m128d va = _mm_loadu_pd(a + i), vb = _mm_loadu_pd(b + i);
+    __m128d diff = _mm_andnot_pd(sign, _mm_sub_pd(va, vb));
+    __m128d ok = _mm_or_pd(_mm_cmpeq_pd(va, vb), _mm_cmple_pd(diff, vtol));
+    uint32_t bad = ~(uint32_t)_mm_movemask_pd(ok) & 0x3;
+
+    if (bad)
+    {
+      if (!*mismatches)
+        *first = i + _ctz32(bad);
+
+      *mismatches += _popcount32(bad);
+    }
+  }
+
+  return i;
+}
+#endif
+
+#ifdef MTEST_AVX2
+__attribute__((target("avx2")))
+static size_t _near_scan_avx2(const float *a, const float *b, size_t count, double tol,
+                              size_t *first, size_t *mismatches)
+{
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256 vtol = _mm256_set1_ps((float)tol);
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+    __m256 diff = _mm256_andnot_ps(sign, _mm256_sub_ps(va, vb));
+    __m256 ok = _mm256_or_ps(_mm256_cmp_ps(va, vb, _CMP_EQ_OQ),
+                             _mm256_cmp_ps(diff, vtol, _CMP_LE_OQ));
+    uint32_t bad = ~(uint32_t)_mm256_movemask_ps(ok) & 0xff;
+
+    if (bad)
+    {
+      if (!*mismatches)
+        *first = i + _ctz32(bad);
+
+      *mismatches += _popcount32(bad);
+    }
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _near_scan_avx2(const double *a, const double *b, size_t count, double tol,
+                              size_t *first, size_t *mismatches)
+{
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d vtol = _mm256_set1_pd(tol);
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4)
+  {
+    __m256d va = _mm256_loadu_pd(a + i), vb = _mm256_loadu_pd(b + i);
+    __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(va, vb));
+    __m256d ok = _mm256_or_pd(_mm256_cmp_pd(va, vb, _CMP_EQ_OQ),
+                              _mm256_cmp_pd(diff, vtol, _CMP_LE_OQ));
+    uint32_t bad = ~(uint32_t)_mm256_movemask_pd(ok) & 0xf;
+
+    if (bad)
+    {
+      if (!*mismatches)
+        *first = i + _ctz32(bad);
+
+      *mismatches += _popcount32(bad);
+    }
+  }
+
+  return i;
+}
+#endif
+
+template <typename T>
+size_t _near_mismatches(const T *a, const T *b, size_t count, double tol,
+                        bool ulp, size_t *first)
+{
+  size_t i = 0;
+  size_t mismatches = 0;
+
+  *first = count;
+
+  // ULP distances are only computed by the scalar loop
+  if (!ulp)
+  {
+#ifdef MTEST_AVX2
+    if (__builtin_cpu_supports("avx2"))
+      i = _near_scan_avx2(a, b, count, tol, first, &mismatches);
+#endif
+#ifdef MTEST_SSE2
+    if (!i)
+      i = _near_scan_sse2(a, b, count, tol, first, &mismatches);
+#endif
+  }
+
+  for (; i < count; ++i)
+    if (!_near_scalar(a[i], b[i], tol, ulp) && !mismatches++)
+      *first = i;
+
+  return mismatches;
+}
+
+template <typename T>
+bool _near_all(void *self, const char *file, int line, bool assertion,
+               const char *lhs, const char *rhs, const T *a, const T *b,
+               size_t count, double tol, bool ulp)
+{
+  size_t first;
+  size_t mismatches = _near_mismatches(a, b, count, tol, ulp, &first);
+
+  if (!mismatches)
+    return true;
+
+  stringstream ss;
+
+  _fail_header(ss, file, line, assertion, lhs, "~=", rhs);
+  ss << " (" << count << " values, tolerance " << tol << (ulp ? " ulp" : "") << "): "
+     << mismatches << " values differ, first at index " << first;
+
+  if (assertion)
+    ss << ", aborting test";
+
+  // Values around the first difference
+  size_t start = first > 2 ? first - 2 : 0;
+  size_t end = first + 3 < count ? first + 3 : count;
+
+  ss << setprecision(sizeof(T) == sizeof(float) ? 9 : 17);
+
+  for (size_t i = start; i < end; ++i)
+    ss << "\n      [" << i << "] " << a[i] << " vs " << b[i]
+       << (_near_scalar(a[i], b[i], tol, ulp) ? "" : " <");
+
+  _add_failure(self, ss.str());
+  return false;
+}
+
+void _hex_window(stringstream &ss, const char *aname, const unsigned char *a, size_t alen,
+                 const char *bname, const unsigned char *b, size_t blen, size_t first)
+{
+  size_t len = alen > blen ? alen : blen;
+
+  if (first >= len)
+    return;
+
+  // Hex dump of the row holding the first difference, past the end of the
+  // shorter buffer only the longer one has bytes to show
+  const unsigned char *bufs[2] = { a, b };
+  size_t lens[2] = { alen, blen };
+  const char *names[2] = { aname, bname };
+  size_t width = max(strlen(aname), strlen(bname));
+  size_t start = first - first % HEX_ROW;
+  size_t end = start + HEX_ROW < len ? start + HEX_ROW : len;
+
+  ss << hex << setfill('0');
+
+  for (int i = 0; i < 2; ++i)
+  {
+    ss << "\n      " << setfill(' ') << setw(width) << left << names[i] << right
+       << setfill('0') << " +0x" << setw(8) << start << ":";
+
+    for (size_t j = start; j < end && j < lens[i]; ++j)
+      ss << " " << setw(2) << (int)bufs[i][j];
+  }
+
+  ss << dec << setfill(' ') << "\n" << string(width + 19, ' ');
+
+  while (end > start && end <= alen && end <= blen && a[end - 1] == b[end - 1])
+    --end;
+
+  for (size_t j = start; j < end; ++j)
+    ss << (j < alen && j < blen && a[j] == b[j] ? "   " : " ^^");
+}
+
+bool _map_file(const char *path, MappedFile *out)
+{
+#ifdef _WIN32
+  HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+
+  if (fh == INVALID_HANDLE_VALUE)
+    return false;
+
+  if (!GetFileSizeEx(fh, &size))
+  {
+    CloseHandle(fh);
+    return false;
+  }
+
+  out->size = (size_t)size.QuadPart;
+
+  // Empty files can't be mapped
+  if (out->size)
+  {
+    HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mh)
+    {
+      out->data = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mh);
+    }
+  }
+
+  CloseHandle(fh);
+#else
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0)
+    return false;
+
+  if (fstat(fd, &st))
+  {
+    close(fd);
+    return false;
+  }
+
+  out->size = (size_t)st.st_size;
+
+  // Empty files can't be mapped
+  if (out->size)
+  {
+    void *addr = mmap(NULL, out->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (addr != MAP_FAILED)
+      out->data = addr;
+  }
+
+  close(fd);
+#endif
+
+  if (out->size && !out->data)
+  {
+    out->size = 0;
+    return false;
+  }
+
+  return true;
+}
+
+void _unmap_file(MappedFile *file)
+{
+  if (file->data)
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+#else
+    munmap((void *)file->data, file->size);
+#endif
+
+  file->data = nullptr;
+  file->size = 0;
+}
+
+bool _write_file(const string &path, const void *data, size_t size)
+{
+  FILE *fp = fopen(path.c_str(), "wb");
+
+  if (!fp)
+    return false;
+
+  bool ok = fwrite(data, 1, size, fp) == size;
+  return !fclose(fp) && ok;
+}
+
+bool _replace_file(const char *path, const void *data, size_t size)
+{
+  // Write a temporary file alongside and rename it over the target, so
+  // readers never see a partially written golden file or cache record.
+  stringstream tmp;
+
+#ifdef _WIN32
+  tmp << path << ".tmp" << GetCurrentProcessId();
+#else
+  tmp << path << ".tmp" << getpid();
+#endif
+
+  if (!_write_file(tmp.str(), data, size))
+  {
+    remove(tmp.str().c_str());
+    return false;
+  }
+
+#ifdef _WIN32
+  bool ok = MoveFileExA(tmp.str().c_str(), path, MOVEFILE_REPLACE_EXISTING);
+#else
+  bool ok = !rename(tmp.str().c_str(), path);
+#endif
+
+  if (!ok)
+    remove(tmp.str().c_str());
+
+  return ok;
+}
+
+void _pool_notify()
+{
+  // Taking the lock orders the notification after a waiter's predicate check
+  {
+    lock_guard<mutex> lock(pool_mutex);
+  }
+
+  pool_cv.notify_all();
+}
+
+bool _pool_take(Task *out)
+{
+  if (pool_queued <= 0)
+    return false;
+
+  // Newest task of our own first, then the oldest task of another worker
+  if (pool_worker)
+  {
+    lock_guard<mutex> lock(pool_worker->mut);
+
+    if (pool_worker->tasks.size())
+    {
+      *out = pool_worker->tasks.back();
+      pool_worker->tasks.pop_back();
+      --pool_queued;
+      return true;
+    }
+  }
+
+  size_t start = pool_worker ? pool_worker->index + 1 : 0;
+
+  for (size_t i = 0; i < threads.size(); ++i)
+  {
+    Thread *victim = threads[(start + i) % threads.size()];
+    lock_guard<mutex> lock(victim->mut);
+
+    if (victim->tasks.size())
+    {
+      *out = victim->tasks.front();
+      victim->tasks.pop_front();
+      --pool_queued;
+      return true;
+    }
+  }
+
+  lock_guard<mutex> lock(pool_mutex);
+
+  if (pool_inject.size())
+  {
+    *out = pool_inject.front();
+    pool_inject.pop_front();
+    --pool_queued;
+    return true;
+  }
+
+  return false;
+}
+
+void _pool_run(Task &task)
+{
+  TaskGroup *group = task.group;
+  Test *prev = current_test;
+
+  // Tasks of the running test are counted with it. Other tasks are counted
+  // separately for their owner, on counters started here if this worker is
+  // idle, or else read around the task and taken out of the running test.
+  bool count = perf_local && task.owner && task.owner != prev;
+  uint64_t before[PERF_EVENTS];
+  Counters delta;
+
+  if (count && prev)
+    count = _perf_read(perf_local, before);
+  else if (count)
+    _perf_start(perf_local);
+
+  current_test = task.owner;
+  task.fn(task.arg);
+  current_test = prev;
+
+  if (count && prev)
+  {
+    delta.valid = _perf_read(perf_local, delta.values);
+
+    for (int i = 0; delta.valid && i < PERF_EVENTS; ++i)
+    {
+      delta.values[i] -= min(delta.values[i], before[i]);
+      perf_foreign[i] += delta.values[i];
+    }
+  }
+  else if (count)
+    _perf_stop(perf_local, &delta);
+
+  if (count)
+    _perf_add(task.owner, delta, perf_local_software);
+
+  if (--group->pending == 0)
+    _pool_notify();
+}
+
+Thread *_idle_worker()
+{
+  for (auto &thr : threads)
+    if (thr->get_req() == -1)
+      return thr;
+
+  return nullptr;
+}
+
+bool _all_idle()
+{
+  for (auto &thr : threads)
+    if (thr->get_req() != -1)
+      return false;
+
+  return true;
+}
+
+bool _read_file(const string &path, string *out)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+
+  if (!fp)
+    return false;
+
+  char buf[4096];
+  size_t len;
+
+  out->clear();
+
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    out->append(buf, len);
+
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+void _make_dir(const string &path)
+{
+#ifdef _WIN32
+  _mkdir(path.c_str());
+#else
+  mkdir(path.c_str(), 0755);
+#endif
+}
+
+bool _list_dir(const string &path, vector<string> *out)
+{
+#ifdef _WIN32
+  WIN32_FIND_DATAA fd;
+  HANDLE dir = FindFirstFileA((path + "/*").c_str(), &fd);
+
+  if (dir == INVALID_HANDLE_VALUE)
+    return false;
+
+  do
+    if (fd.cFileName[0] != '.')
+      out->push_back(fd.cFileName);
+  while (FindNextFileA(dir, &fd));
+
+  FindClose(dir);
+#else
+  DIR *dir = opendir(path.c_str());
+
+  if (!dir)
+    return false;
+
+  while (struct dirent *ent = readdir(dir))
+    if (ent->d_name[0] != '.')
+      out->push_back(ent->d_name);
+
+  closedir(dir);
+#endif
+
+  sort(out->begin(), out->end());
+  return true;
+}
+
+void _fuzz_replay(void *self)
+{
+  // Normal runs check the empty input and every corpus file
+  Test *test = (Test *)self;
+  string dir = corpus_dir + "/" + test->name;
+  vector<string> files;
+  string input;
+
+  test->ffun(self, (const uint8_t *)input.data(), 0);
+  _list_dir(dir, &files);
+
+  for (auto &f : files)
+  {
+    string path = dir + "/" + f;
+    size_t before = test->failures.size();
+
+    if (!_read_file(path, &input))
+      continue;
+
+    test->ffun(self, (const uint8_t *)input.data(), input.size());
+
+    if (test->failures.size() != before)
+      _add_failure(self, "[" + path + "] failing input");
+  }
+}
+
+int _fuzz_run(Fuzzer &fz, int num_threads)
+{
+  vector<string> files;
+  vector<uint8_t> local(FUZZ_MAP_SIZE);
+  Test scratch(fz.test.tfun, fz.test.name);
+  string input;
+
+  scratch.ffun = fz.test.ffun;
+
+#ifndef MTEST_SANCOV
+  cout << "    > No coverage feedback, build with MTEST_SANCOV to enable it" << endl;
+#endif
+
+  _make_dir(corpus_dir);
+  _make_dir(fz.dir);
+  // Crashes go to the working directory, outside the replayed corpus, so
+  // that a crashing input doesn't take down every later normal run
+  snprintf(fuzz_crash_prefix, sizeof(fuzz_crash_prefix), "crash-");
+
+  signal(SIGSEGV, _fuzz_signal);
+  signal(SIGFPE, _fuzz_signal);
+  signal(SIGILL, _fuzz_signal);
+  signal(SIGABRT, _fuzz_signal);
+#ifdef SIGBUS
+  signal(SIGBUS, _fuzz_signal);
+#endif
+
+  // Seed the coverage map with the existing corpus
+  fuzz_map = new uint8_t[FUZZ_MAP_SIZE];
+  _list_dir(fz.dir, &files);
+  files.insert(files.begin(), "");
+
+  for (auto &f : files)
+  {
+    if (f.size() && !_read_file(fz.dir + "/" + f, &input))
+      continue;
+
+    if (_fuzz_exec(scratch, input))
+    {
+      cout << "    > Corpus input " << (f.size() ? f : "(empty)") << " fails:" << endl;
+
+      for (auto &msg : scratch.failures)
+        cout << "    " << msg << endl;
+
+      delete[] fuzz_map;
+      return -1;
+    }
+
+    if (!_fuzz_merge(fz, local, input))
+      fz.corpus.push_back(input);
+  }
+
+  delete[] fuzz_map;
+  fuzz_map = nullptr;
+
+  cout << "    > Fuzzing " << fz.test.name << " on " << num_threads << " threads with "
+       << fz.corpus.size() << " corpus inputs for " << fuzz_seconds << " seconds" << endl;
+
+  // Fuzzing threads replace the test workers
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> fuzzers;
+
+  for (int i = 0; i < num_threads; ++i)
+    fuzzers.push_back(thread(mtest_fuzz_main, &fz));
+
+  long long last_execs = 0;
+  chrono::steady_clock::time_point last = start;
+
+  while (1)
+  {
+    {
+      unique_lock<mutex> lock(fz.mut);
+
+      if (fz.stop)
+        break;
+    }
+
+    _wait(100);
+
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - start).count();
+    double since = chrono::duration<double>(now - last).count();
+
+    if (elapsed >= fuzz_seconds)
+      break;
+
+    if (since < 1)
+      continue;
+
+    long long execs = fz.execs;
+    lock_guard<mutex> lock(fz.mut);
+
+    cout << "    > #" << execs << " cov: " << fz.covered << " corpus: " << fz.corpus.size()
+         << " exec/s: " << (long long)((execs - last_execs) / since) << endl;
+
+    last_execs = execs;
+    last = now;
+  }
+
+  {
+    lock_guard<mutex> lock(fz.mut);
+    fz.stop = true;
+  }
+
+  for (auto &thr : fuzzers)
+    thr.join();
+
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << "    > Ran " << fz.execs << " inputs in " << setprecision(3) << elapsed
+       << " seconds (" << (long long)(fz.execs / elapsed) << " exec/s), cov: "
+       << fz.covered << " corpus: " << fz.corpus.size() << endl;
+
+  if (fz.crash.size() || fz.failures.size())
+  {
+    _print_centered_header("FAILING INPUT FOR %s", fz.test.name);
+    cout << "    > Minimized to " << fz.crash.size() << " bytes, saved as "
+         << _fuzz_save(".", "crash-", fz.crash) << endl;
+
+    for (auto &msg : fz.failures)
+      cout << "    " << msg << endl;
+
+    return -1;
+  }
+
+  _print_centered_header("NO FAILING INPUTS FOUND");
+  return 0;
+}
+
+void mtest_fuzz_main(void *ud)
+{
+  Fuzzer &fz = *(Fuzzer *)ud;
+  Test scratch(fz.test.tfun, fz.test.name);
+  vector<uint8_t> local(FUZZ_MAP_SIZE);
+  uint64_t rng = (uint64_t)chrono::steady_clock::now().time_since_epoch().count()
+                 ^ hash<thread::id>()(this_thread::get_id());
+  string input, other;
+
+  scratch.ffun = fz.test.ffun;
+  fuzz_map = new uint8_t[FUZZ_MAP_SIZE];
+
+  {
+    lock_guard<mutex> lock(fz.mut);
+    local = fz.seen;
+  }
+
+  while (1)
+  {
+    {
+      lock_guard<mutex> lock(fz.mut);
+
+      if (fz.stop)
+        break;
+
+      input = fz.corpus[_rand64(&rng) % fz.corpus.size()];
+      other = fz.corpus[_rand64(&rng) % fz.corpus.size()];
+    }
+
+    _fuzz_mutate(input, other, &rng);
+    bool failed = _fuzz_exec(scratch, input);
+    ++fz.execs;
+
+    if (failed)
+    {
+      string minimized = _fuzz_minimize(scratch, input);
+      lock_guard<mutex> lock(fz.mut);
+
+      // Keep the first failure only
+      if (!fz.stop)
+      {
+        fz.stop = true;
+        fz.crash = minimized;
+        fz.failures = scratch.failures;
+      }
+
+      break;
+    }
+
+    if (_fuzz_merge(fz, local, input))
+      _fuzz_save(fz.dir, "", input);
+  }
+
+  delete[] fuzz_map;
+  fuzz_map = nullptr;
+}
+
+bool _fuzz_exec(Test &scratch, const string &input)
+{
+  scratch.failures.clear();
+  memset(fuzz_map, 0, FUZZ_MAP_SIZE);
+
+  fuzz_input = &input;
+  scratch.ffun(&scratch, (const uint8_t *)input.data(), input.size());
+  fuzz_input = nullptr;
+
+  return scratch.failures.size();
+}
+
+bool _fuzz_merge(Fuzzer &fz, vector<uint8_t> &local, const string &input)
+{
+  // Most inputs cover nothing new, so check against our copy before locking
+  const uint64_t *words = (const uint64_t *)fuzz_map;
+  bool candidate = false;
+
+  for (size_t i = 0; i < FUZZ_MAP_SIZE / 8 && !candidate; ++i)
+    if (words[i])
+      for (size_t j = i * 8; j < i * 8 + 8; ++j)
+        if (fuzz_map[j] && !local[j])
+          candidate = true;
+
+  if (!candidate)
+    return false;
+
+  lock_guard<mutex> lock(fz.mut);
+  size_t added = 0;
+
+  for (size_t i = 0; i < FUZZ_MAP_SIZE; ++i)
+    if (fuzz_map[i] && !fz.seen[i])
+    {
+      fz.seen[i] = 1;
+      ++added;
+    }
+
+  local = fz.seen;
+
+  if (!added || fz.stop)
+    return false;
+
+  fz.covered += added;
+  fz.corpus.push_back(input);
+  return true;
+}
+
+void _fuzz_mutate(string &buf, const string &other, uint64_t *rng)
+{
+  static const uint8_t interesting[] = { 0, 1, 0x7f, 0x80, 0xff };
+  int ops = 1 + _rand64(rng) % 4;
+
+  for (int i = 0; i < ops; ++i)
+  {
+    size_t pos = buf.size() ? _rand64(rng) % buf.size() : 0;
+
+    switch (_rand64(rng) % 7)
+    {
+    case 0: // flip a bit
+      if (buf.size())
+        buf[pos] ^= (char)(1 << (_rand64(rng) % 8));
+      break;
+    case 1: // random byte
+      if (buf.size())
+        buf[pos] = (char)_rand64(rng);
+      break;
+    case 2: // insert a byte
+      if (buf.size() < FUZZ_MAX_LEN)
+        buf.insert(buf.begin() + pos, (char)_rand64(rng));
+      break;
+    case 3: // erase a range
+      if (buf.size())
+        buf.erase(pos, 1 + _rand64(rng) % (buf.size() - pos));
+      break;
+    case 4: // interesting value
+      if (buf.size())
+        buf[pos] = (char)interesting[_rand64(rng) % sizeof(interesting)];
+      break;
+    case 5: // small arithmetic
+      if (buf.size())
+        buf[pos] = (char)(buf[pos] + (int)(_rand64(rng) % 33) - 16);
+      break;
+    case 6: // splice in part of another input
+      if (other.size())
+      {
+        size_t from = _rand64(rng) % other.size();
+        size_t len = 1 + _rand64(rng) % (other.size() - from);
+        buf.insert(pos, other, from, len);
+      }
+      break;
+    }
+  }
+
+  if (buf.size() > FUZZ_MAX_LEN)
+    buf.resize(FUZZ_MAX_LEN);
+}
+
+string _fuzz_minimize(Test &scratch, string input)
+{
+  // Remove ever smaller chunks for as long as the input keeps failing
+  vector<string> failures = scratch.failures;
+
+  for (size_t chunk = input.size() / 2; chunk; chunk /= 2)
+    for (size_t pos = 0; pos + chunk <= input.size();)
+    {
+      string candidate = input.substr(0, pos) + input.substr(pos + chunk);
+
+      if (_fuzz_exec(scratch, candidate))
+      {
+        input = candidate;
+        failures = scratch.failures;
+      }
+      else
+        pos += chunk;
+    }
+
+  scratch.failures = failures;
+  return input;
+}
+
+string _fuzz_save(const string &dir, const char *prefix, const string &data)
+{
+  char name[17];
+  uint64_t h = _hash_bytes(0xcbf29ce484222325ULL, data.data(), data.size());
+
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)h);
+
+  string path = dir + "/" + prefix + name;
+  _write_file(path, data.data(), data.size());
+  return path;
+}
+
+void _fuzz_signal(int sig)
+{
+  // Save the input which crashed this thread, using only async-signal-safe
+  // calls, before handing the signal to the default handler.
+  static const char digits[] = "0123456789abcdef";
+  const string *input = fuzz_input;
+
+  signal(sig, SIG_DFL);
+
+  if (input)
+  {
+    char path[sizeof(fuzz_crash_prefix) + 17];
+    size_t len = strlen(fuzz_crash_prefix);
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < input->size(); ++i)
+    {
+      h ^= (unsigned char)(*input)[i];
+      h *= 0x100000001b3ULL;
+    }
+
+    memcpy(path, fuzz_crash_prefix, len);
+
+    for (int i = 0; i < 16; ++i)
+      path[len + i] = digits[(h >> (60 - 4 * i)) & 0xf];
+
+    path[len + 16] = '\0';
+
+#ifdef _WIN32
+    FILE *fp = fopen(path, "wb");
+
+    if (fp)
+    {
+      fwrite(input->data(), 1, input->size(), fp);
+      fclose(fp);
+    }
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd >= 0)
+    {
+      if (write(fd, input->data(), input->size()) < 0) {}
+      close(fd);
+    }
+
+    const char msg[] = "\n    > Crashing input saved as ";
+
+    if (write(2, msg, sizeof(msg) - 1) < 0 || write(2, path, strlen(path)) < 0
+        || write(2, "\n", 1) < 0) {}
+#endif
+  }
+
+  raise(sig);
+}
+
+uint64_t _rand64(uint64_t *state)
+{
+  // xorshift64*
+  uint64_t x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+#ifdef MTEST_SANCOV
+// SanitizerCoverage callbacks. Clang calls the guard variants when built with
+// -fsanitize-coverage=trace-pc-guard, GCC only supports trace-pc. Hits are
+// recorded in the calling thread's map, so concurrent fuzzers don't mix.
+static uint32_t fuzz_guards;
+
+extern "C" MT_NO_COVERAGE void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop)
+{
+  if (start == stop || *start)
+    return;
+
+  for (uint32_t *g = start; g < stop; ++g)
+    *g = ++fuzz_guards;
+}
+
+extern "C" MT_NO_COVERAGE void __sanitizer_cov_trace_pc_guard(uint32_t *guard)
+{
+  if (fuzz_map)
+    fuzz_map[*guard & (FUZZ_MAP_SIZE - 1)] = 1;
+}
+
+extern "C" MT_NO_COVERAGE void __sanitizer_cov_trace_pc()
+{
+  if (fuzz_map)
+  {
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    fuzz_map[(pc ^ (pc >> 16)) & (FUZZ_MAP_SIZE - 1)] = 1;
+  }
+}
+#endif
+
+bool _history_load()
+{
+  FILE *fp = fopen(history_path.c_str(), "r");
+
+  // A missing history is fine, this is the first run
+  if (!fp)
+    return errno == ENOENT;
+
+  long runs;
+  char name[4096];
+  History h;
+
+  if (fscanf(fp, "mtest-history %ld\n", &runs) != 1)
+  {
+    fclose(fp);
+    return false;
+  }
+
+  while (fscanf(fp, "%lf %ld %ld %ld %4095s\n", &h.ewma_ms, &h.first_seen,
+                &h.last_run, &h.last_fail, name) == 5)
+    history[name] = h;
+
+  fclose(fp);
+  history_run = runs;
+
+  // Untimed tests are assumed to take as long as the median timed test
+  vector<double> known;
+
+  for (auto &it : history)
+    if (it.second.ewma_ms >= 0)
+      known.push_back(it.second.ewma_ms);
+
+  if (known.size())
+  {
+    nth_element(known.begin(), known.begin() + known.size() / 2, known.end());
+    history_median = known[known.size() / 2];
+  }
+
+  return true;
+}
+
+bool _history_save()
+{
+  stringstream ss;
+
+  ss << "mtest-history " << history_run + 1 << "\n";
+
+  // Records of tests which no longer exist are dropped
+  for (auto &it : *all_tests)
+  {
+    Test &test = it.second;
+    History h = history.count(it.first) ? history[it.first] : History();
+
+    if (!history.count(it.first))
+      h.first_seen = history_run;
+
+    if (test.ran)
+      h.last_run = history_run;
+
+    if (test.failed)
+      h.last_fail = history_run;
+
+    if (test.wall_ms >= 0)
+      h.ewma_ms = h.ewma_ms < 0
+        ? test.wall_ms
+        : (1 - HISTORY_ALPHA) * h.ewma_ms + HISTORY_ALPHA * test.wall_ms;
+
+    ss << setprecision(6) << h.ewma_ms << " " << h.first_seen << " " << h.last_run
+       << " " << h.last_fail << " " << it.first << "\n";
+  }
+
+  string data = ss.str();
+  return _replace_file(history_path.c_str(), data.data(), data.size());
+}
+
+double _test_value(const string &name)
+{
+  auto it = history.find(name);
+
+  // Tests we know nothing about are as valuable as recently added ones
+  if (it == history.end())
+    return 5;
+
+  const History &h = it->second;
+  double value = 1;
+
+  // Recent failures count most, halving with every run since
+  if (h.last_fail >= 0)
+    value += 8 * pow(0.5, (double)(history_run - 1 - h.last_fail));
+
+  // Recently added
+  if (history_run - h.first_seen <= 3)
+    value += 4;
+
+  // Not run lately, for example skipped by earlier budgeted runs
+  long idle = h.last_run < 0 ? history_run : history_run - 1 - h.last_run;
+  value += 0.5 * (idle < 10 ? idle : 10);
+
+  return value;
+}
+
+double _test_estimate(const string &name)
+{
+  auto it = history.find(name);
+
+  if (it != history.end() && it->second.ewma_ms >= 0)
+    return it->second.ewma_ms;
+
+  return history_median;
+}
+
+void _budget_select(vector<string> &to_run, int num_threads, vector<string> *skipped)
+{
+  // Greedily fill the budget by value per millisecond, leaving some headroom
+  // for estimation errors and uneven packing onto the workers.
+  struct Candidate
+  {
+    string name;
+    double value;
+    double ms;
+  };
+
+  vector<Candidate> candidates;
+  double capacity = time_budget * 1000 * num_threads * BUDGET_FILL;
+  double planned = 0;
+
+  for (auto &name : to_run)
+  {
+    Candidate c = { name, _test_value(name), _test_estimate(name) };
+    candidates.push_back(c);
+  }
+
+  sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+    return a.value / max(a.ms, 1.0) > b.value / max(b.ms, 1.0);
+  });
+
+  vector<Candidate> picked;
+
+  for (auto &c : candidates)
+  {
+    if (planned + c.ms <= capacity)
+    {
+      planned += c.ms;
+      picked.push_back(c);
+    }
+    else
+      skipped->push_back(c.name);
+  }
+
+  // Run the most valuable tests first, so running out of time loses the least
+  stable_sort(picked.begin(), picked.end(), [](const Candidate &a, const Candidate &b) {
+    return a.value > b.value;
+  });
+
+  to_run.clear();
+
+  for (auto &c : picked)
+    to_run.push_back(c.name);
+}
+
+void _mtest_log_values(void *self, const _mtest_value *vals, size_t count)
+{
+  stringstream ss;
+
+  for (size_t i = 0; i < count; ++i)
+    vals[i].print(ss, vals[i].ptr);
+
+  ss << "\n";
+
+  string line = ss.str();
+  _log_append((Test *)self, line.data(), line.size());
+}
+
+void _log_append(Test *test, const char *data, size_t len)
+{
+  LogRing *ring;
+
+  {
+    lock_guard<mutex> lock(log_mutex);
+
+    if (!test->log)
+      test->log = new LogRing();
+
+    ring = test->log;
+  }
+
+  lock_guard<mutex> lock(ring->mut);
+
+  if (ring->written + len <= LOG_RING_SIZE)
+  {
+    ring->data.insert(ring->data.end(), data, data + len);
+    ring->written += len;
+    return;
+  }
+
+  ring->data.resize(LOG_RING_SIZE);
+
+  // Only the tail of oversized writes can survive
+  if (len > LOG_RING_SIZE)
+  {
+    ring->written += len - LOG_RING_SIZE;
+    data += len - LOG_RING_SIZE;
+    len = LOG_RING_SIZE;
+  }
+
+  size_t pos = ring->written % LOG_RING_SIZE;
+  size_t first = min(len, (size_t)LOG_RING_SIZE - pos);
+
+  memcpy(&ring->data[pos], data, first);
+  memcpy(&ring->data[0], data + first, len - first);
+  ring->written += len;
+}
+
+void _print_failures(ostream &os, Test &test, bool quiet)
+{
+  if (!quiet)
+    os << test.name << ":" << endl;
+
+  for (auto &f : test.failures)
+    os << "    " << f << endl;
+
+  _log_print(os, test);
+}
+
+void _log_print(ostream &os, Test &test)
+{
+  LogRing *ring = test.log;
+
+  if (!ring || !ring->written)
+    return;
+
+  string text;
+  size_t pos = ring->written % LOG_RING_SIZE;
+
+  if (ring->written <= LOG_RING_SIZE)
+    text.assign(&ring->data[0], ring->written);
+  else
+  {
+    text.assign(&ring->data[pos], LOG_RING_SIZE - pos);
+    text.append(&ring->data[0], pos);
+
+    // Skip the partial first line
+    size_t nl = text.find('\n');
+    text.erase(0, nl == string::npos ? 0 : nl + 1);
+  }
+
+  os << "    log:" << endl;
+
+  if (ring->written > LOG_RING_SIZE)
+    os << "      (earlier output dropped, " << LOG_RING_SIZE / 1024 << " KiB kept)" << endl;
+
+  size_t start = 0;
+
+  while (start < text.size())
+  {
+    size_t end = text.find('\n', start);
+
+    if (end == string::npos)
+      end = text.size();
+
+    os << "      " << text.substr(start, end - start) << endl;
+    start = end + 1;
+  }
+}
+
+int CaptureBuf::overflow(int ch)
+{
+  if (ch == EOF)
+    return 0;
+
+  char c = (char)ch;
+
+  if (current_test)
+  {
+    _log_append(current_test, &c, 1);
+    return ch;
+  }
+
+  return orig->sputc(c);
+}
+
+streamsize CaptureBuf::xsputn(const char *s, streamsize n)
+{
+  if (current_test)
+  {
+    _log_append(current_test, s, (size_t)n);
+    return n;
+  }
+
+  return orig->sputn(s, n);
+}
+
+int CaptureBuf::sync()
+{
+  return current_test ? 0 : orig->pubsync();
+}
@@ -11,10 +11,25 @@
 #ifndef MTEST_H
 #define MTEST_H
 
+// With MTEST_LIGHT defined, only forward declarations of the iostream
+// classes are included. Values of types other than the builtin types, enums,
+// pointers, nullptr and strings compared with EXPECT_OP() then need <ostream>.
+#ifdef MTEST_LIGHT
+#include <iosfwd>
+#else
 #include <iostream>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <type_traits>
 
 #define MT_STRINGIFY2(x) #x
 #define MT_STRINGIFY(x) MT_STRINGIFY2(x)
+#define MT_CONCAT2(a, b) a##b
+#define MT_CONCAT(a, b) MT_CONCAT2(a, b)
 
 /**
  * Defines a test. Tests should be defined as functions, for example
@@ -35,6 +50,28 @@
   static int _test_add_##name = _mtest_push(#name, &_test_##name);             \
   void _test_##name(void *__self)
 
+/**
+ * Defines a fuzz test, which takes an input buffer instead of no arguments:
+ *
+ * FUZZ_TEST(ParseHeader, const uint8_t *data, size_t len) {
+ *   Header h;
+ *   if (parse_header(data, len, &h))
+ *     EXPECT_LE(h.size, len);
+ * }
+ *
+ * In normal runs the test is called once with an empty input and once for
+ * every file in its corpus directory (corpus/<name> by default). Running with
+ * --mtest-fuzz <name> mutates the corpus on every worker thread until a
+ * failing input is found or the time limit passes.
+ *
+ * @param name Test name token.
+ * @param ...  Parameter list, (const uint8_t *data, size_t len).
+ */
+#define FUZZ_TEST(name, ...)                                                   \
+  static void _fuzz_##name(void *s, __VA_ARGS__);                              \
+  static int _test_add_##name = _mtest_push_fuzz(#name, &_fuzz_##name);        \
+  void _fuzz_##name(void *__self, __VA_ARGS__)
+
 /**
  * Tests that a condition is true. If the condition does not evaluate to a
  * nonzero value, the test is considered failed and this macro is reported.
@@ -45,9 +82,7 @@
 #define EXPECT(cond)                                                           \
   {                                                                            \
     if (!(cond)) {                                                             \
-      _mtest_fail(__self)                                                      \
-        << "[" << __FILE__ << ":" << __LINE__ << "] "                          \
-        << "failed expectation \"" << #cond << "\"";                           \
+      _mtest_fail_cond(__self, __FILE__, __LINE__, false, #cond);              \
     }                                                                          \
   }
 
@@ -62,10 +97,8 @@
 #define EXPECT_OP(lhs, op, rhs)                                                \
   {                                                                            \
     if (!((lhs) op (rhs))) {                                                   \
-      _mtest_fail(__self)                                                      \
-        << __FILE__ << ":" << __LINE__ << " | "                                \
-        << "failed expectation \"" << #lhs << " " << #op << " " << #rhs        \
-        << "\": \"" << lhs << "\" !" #op << " \"" << rhs << "\"";              \
+      _mtest_fail_op(__self, __FILE__, __LINE__, false, #lhs, #op, #rhs,       \
+                     _mtest_val(lhs), _mtest_val(rhs));                        \
     }                                                                          \
   }
 
@@ -86,9 +119,7 @@
 #define ASSERT(cond)                                                           \
   {                                                                            \
     if (!(cond)) {                                                             \
-      _mtest_fail(__self)                                                      \
-        << "[" << __FILE__ << ":" << __LINE__ << "] "                          \
-        << "failed assertion \"" << #cond << "\", aborting test";              \
+      _mtest_fail_cond(__self, __FILE__, __LINE__, true, #cond);               \
       return;                                                                  \
     }                                                                          \
   }
@@ -104,11 +135,8 @@
 #define ASSERT_OP(lhs, op, rhs)                                                \
   {                                                                            \
     if (!((lhs) op (rhs))) {                                                   \
-      _mtest_fail(__self)                                                      \
-        << "[" << __FILE__ << ":" << __LINE__ << "] "                          \
-        << "failed assertion \"" << #lhs << " " << #op << " " << #rhs          \
-        << "\": \"" << lhs << "\" !" #op << " \"" << rhs << "\", "             \
-        << "aborting test";                                                    \
+      _mtest_fail_op(__self, __FILE__, __LINE__, true, #lhs, #op, #rhs,        \
+                     _mtest_val(lhs), _mtest_val(rhs));                        \
       return;                                                                  \
     }                                                                          \
   }
@@ -120,6 +148,121 @@
 #define ASSERT_GT(lhs, rhs) ASSERT_OP(lhs, >, rhs)
 #define ASSERT_GE(lhs, rhs) ASSERT_OP(lhs, >=, rhs)
 
+/**
+ * Tests that two buffers hold the same bytes. On failure the number of
+ * differing bytes, the first differing offset and a hex dump around it are
+ * reported. The test will continue on regardless if this condition passes
+ * or fails.
+ *
+ * @param lhs Pointer to the first buffer.
+ * @param rhs Pointer to the second buffer.
+ * @param len Length of both buffers in bytes.
+ */
+#define EXPECT_MEM_EQ(lhs, rhs, len)                                           \
+  {                                                                            \
+    _mtest_mem_eq(__self, __FILE__, __LINE__, false, #lhs, #rhs,               \
+                  (lhs), (rhs), (len));                                        \
+  }
+
+/**
+ * Tests that two ranges (containers or arrays) hold equal elements. On
+ * failure the number of differing elements and the first difference are
+ * reported. The test will continue on regardless if this condition passes
+ * or fails.
+ *
+ * @param lhs First range.
+ * @param rhs Second range.
+ */
+#define EXPECT_RANGE_EQ(lhs, rhs)                                              \
+  {                                                                            \
+    _mtest_range_eq(__self, __FILE__, __LINE__, false, #lhs, #rhs,             \
+                    (lhs), (rhs));                                             \
+  }
+
+/**
+ * Tests that two float or double arrays are equal within an absolute
+ * tolerance. NaNs never match. The test will continue on regardless if this
+ * condition passes or fails.
+ *
+ * @param lhs   Pointer to the first array.
+ * @param rhs   Pointer to the second array.
+ * @param count Number of elements.
+ * @param tol   Largest allowed absolute difference.
+ */
+#define EXPECT_NEAR_ALL(lhs, rhs, count, tol)                                  \
+  {                                                                            \
+    _mtest_near_all(__self, __FILE__, __LINE__, false, #lhs, #rhs,             \
+                    (lhs), (rhs), (count), (tol), false);                      \
+  }
+
+/**
+ * Like EXPECT_NEAR_ALL(), with the tolerance given in units in the last
+ * place (ULPs).
+ */
+#define EXPECT_NEAR_ALL_ULP(lhs, rhs, count, ulps)                             \
+  {                                                                            \
+    _mtest_near_all(__self, __FILE__, __LINE__, false, #lhs, #rhs,             \
+                    (lhs), (rhs), (count), (ulps), true);                      \
+  }
+
+// Variants of the above which terminate the test immediately on failure.
+
+#define ASSERT_MEM_EQ(lhs, rhs, len)                                           \
+  {                                                                            \
+    if (!_mtest_mem_eq(__self, __FILE__, __LINE__, true, #lhs, #rhs,           \
+                       (lhs), (rhs), (len)))                                   \
+      return;                                                                  \
+  }
+
+#define ASSERT_RANGE_EQ(lhs, rhs)                                              \
+  {                                                                            \
+    if (!_mtest_range_eq(__self, __FILE__, __LINE__, true, #lhs, #rhs,         \
+                         (lhs), (rhs)))                                        \
+      return;                                                                  \
+  }
+
+#define ASSERT_NEAR_ALL(lhs, rhs, count, tol)                                  \
+  {                                                                            \
+    if (!_mtest_near_all(__self, __FILE__, __LINE__, true, #lhs, #rhs,         \
+                         (lhs), (rhs), (count), (tol), false))                 \
+      return;                                                                  \
+  }
+
+#define ASSERT_NEAR_ALL_ULP(lhs, rhs, count, ulps)                             \
+  {                                                                            \
+    if (!_mtest_near_all(__self, __FILE__, __LINE__, true, #lhs, #rhs,         \
+                         (lhs), (rhs), (count), (ulps), true))                 \
+      return;                                                                  \
+  }
+
+/**
+ * Tests that a buffer matches the contents of a golden file. The golden file
+ * is memory-mapped and compared in place. On mismatch the data is written to
+ * `<path>.actual` next to it. When running with --mtest-update-golden the
+ * golden file is atomically replaced with the data instead. The test will
+ * continue on regardless if this condition passes or fails.
+ *
+ * @param data Data to check, either a C string or anything with data() and
+ *             size() (std::string, std::vector<char>, ...).
+ * @param path Path to the golden file.
+ */
+#define EXPECT_MATCHES_GOLDEN(data, path)                                      \
+  {                                                                            \
+    _mtest_golden(__self, __FILE__, __LINE__, false, #data,                    \
+                  _mtest_to_bytes(data), (path));                              \
+  }
+
+/**
+ * Like EXPECT_MATCHES_GOLDEN(), but terminates the test immediately on
+ * failure.
+ */
+#define ASSERT_MATCHES_GOLDEN(data, path)                                      \
+  {                                                                            \
+    if (!_mtest_golden(__self, __FILE__, __LINE__, true, #data,                \
+                       _mtest_to_bytes(data), (path)))                         \
+      return;                                                                  \
+  }
+
 /**
  * Runs all tests registered with TEST(). Returns 0 if all tests pass,
  * or -1 if one or more tests failed.
@@ -130,12 +273,534 @@
  */
 int mtest_main(int argc, char **argv);
 
+/**
+ * Records a span covering the rest of the enclosing scope in the trace
+ * written by --mtest-trace. Does nothing when tracing is disabled.
+ *
+ * {
+ *   MT_TRACE_SCOPE("load fixtures");
+ *   // ...
+ * }
+ *
+ * @param name Span name, must be a string literal.
+ */
+#define MT_TRACE_SCOPE(name)                                                   \
+  _mtest_trace_scope MT_CONCAT(_mtest_trace_, __LINE__)(name)
+
+/**
+ * Appends a line to the log of the running test. Logs are kept in memory,
+ * in a bounded ring per test, and are only printed with the failure summary
+ * when the test fails. The arguments are printed one after another:
+ *
+ * MT_LOG("decoded ", frames, " frames in ", ms, " ms");
+ *
+ * Running with --mtest-capture also sends std::cout and std::cerr output of
+ * tests to their logs.
+ */
+#define MT_LOG(...) _mtest_log(__self, __VA_ARGS__)
+
+/**
+ * Runs a block once for every value in [begin, end) on the mtest worker
+ * pool. The calling thread helps run the iterations and returns once all of
+ * them have finished. Assertions inside the block only abort the current
+ * iteration.
+ *
+ * MT_PARALLEL_FOR(i, 0, inputs.size(), {
+ *   EXPECT_EQ(decode(encode(inputs[i])), inputs[i]);
+ * });
+ *
+ * The loop takes explicit bounds rather than a range object, as mtest.h
+ * targets C++11 and has no range type to split. Naming the variable lets the
+ * body read like a plain for loop, and its type follows the bounds.
+ *
+ * @param var   Name of the loop variable.
+ * @param begin First value.
+ * @param end   One past the last value.
+ */
+#define MT_PARALLEL_FOR(var, begin, end, ...)                                  \
+  mtest_parallel_for((begin), (end),                                           \
+                     [&](decltype((begin) + (end)) var) __VA_ARGS__)
+
+/**
+ * Type-erased reference to a value printed in a failure message. Printers
+ * for common types are defined out-of-line in mtest.cpp, so assertions on
+ * them don't instantiate any stream code in the test translation unit.
+ */
+struct _mtest_value
+{
+  const void *ptr;
+  void (*print)(std::ostream &os, const void *ptr);
+};
+
+template <typename T>
+struct _mtest_printer
+{
+  static void print(std::ostream &os, const void *ptr)
+  {
+    print(os, *(const T *)ptr, std::is_enum<T>());
+  }
+
+  static void print(std::ostream &os, const T &val, std::false_type) { os << val; }
+  static void print(std::ostream &os, const T &val, std::true_type);
+};
+
+template <typename T>
+struct _mtest_printer<T *>
+{
+  static void print(std::ostream &os, const void *ptr);
+};
+
+#define MT_DECLARE_PRINTER(T)                                                  \
+  template <> struct _mtest_printer<T>                                         \
+  {                                                                            \
+    static void print(std::ostream &os, const void *ptr);                      \
+  };
+
+MT_DECLARE_PRINTER(bool)
+MT_DECLARE_PRINTER(char)
+MT_DECLARE_PRINTER(signed char)
+MT_DECLARE_PRINTER(unsigned char)
+MT_DECLARE_PRINTER(short)
+MT_DECLARE_PRINTER(unsigned short)
+MT_DECLARE_PRINTER(int)
+MT_DECLARE_PRINTER(unsigned int)
+MT_DECLARE_PRINTER(long)
+MT_DECLARE_PRINTER(unsigned long)
+MT_DECLARE_PRINTER(long long)
+MT_DECLARE_PRINTER(unsigned long long)
+MT_DECLARE_PRINTER(float)
+MT_DECLARE_PRINTER(double)
+MT_DECLARE_PRINTER(long double)
+MT_DECLARE_PRINTER(char *)
+MT_DECLARE_PRINTER(const char *)
+MT_DECLARE_PRINTER(std::nullptr_t)
+
+// Enums print as their underlying integer, which needs no operator<< for the
+// enum itself (and so works with only <iosfwd> included). Promotion keeps
+// enums based on char types from printing as characters.
+template <typename T>
+void _mtest_printer<T>::print(std::ostream &os, const T &val, std::true_type)
+{
+  typedef decltype(+typename std::underlying_type<T>::type()) U;
+  U u = (U)val;
+  _mtest_printer<U>::print(os, &u);
+}
+
+void _mtest_print_ptr(std::ostream &os, const void *ptr);
+void _mtest_print_chars(std::ostream &os, const void *ptr);
+void _mtest_print_buf(std::ostream &os, const char *buf, size_t len);
+
+template <typename T>
+void _mtest_printer<T *>::print(std::ostream &os, const void *ptr)
+{
+  _mtest_print_ptr(os, *(T *const *)ptr);
+}
+
+// Character arrays (string literals) print as strings
+template <size_t N>
+struct _mtest_printer<char[N]>
+{
+  static void print(std::ostream &os, const void *ptr) { _mtest_print_chars(os, ptr); }
+};
+
+// Strings (anything with a char data() and size()) print as their contents
+template <typename S>
+struct _mtest_str_printer
+{
+  static void print(std::ostream &os, const void *ptr)
+  {
+    _mtest_print_buf(os, ((const S *)ptr)->data(), ((const S *)ptr)->size());
+  }
+};
+
+char _mtest_is_chars(const char *);
+
+template <typename T>
+inline auto _mtest_val_impl(const T &val, int)
+  -> decltype(_mtest_is_chars(val.data()), val.size(), _mtest_value())
+{
+  _mtest_value v = { &val, &_mtest_str_printer<T>::print };
+  return v;
+}
+
+template <typename T>
+inline _mtest_value _mtest_val_impl(const T &val, long)
+{
+  _mtest_value v = { &val, &_mtest_printer<T>::print };
+  return v;
+}
+
+template <typename T>
+inline _mtest_value _mtest_val(const T &val)
+{
+  return _mtest_val_impl(val, 0);
+}
+
 int _mtest_push(const char* name, void(*tfun)(void*));
-std::ostream& _mtest_fail(void *self);
+int _mtest_push_fuzz(const char* name, void(*ffun)(void*, const uint8_t*, size_t));
+void _mtest_fail_cond(void *self, const char *file, int line, bool assertion,
+                      const char *cond);
+void _mtest_fail_op(void *self, const char *file, int line, bool assertion,
+                    const char *lhs, const char *op, const char *rhs,
+                    _mtest_value lval, _mtest_value rval);
+bool _mtest_mem_eq(void *self, const char *file, int line, bool assertion,
+                   const char *lhs, const char *rhs,
+                   const void *lbuf, const void *rbuf, size_t len);
+bool _mtest_near_all(void *self, const char *file, int line, bool assertion,
+                     const char *lhs, const char *rhs,
+                     const float *lbuf, const float *rbuf, size_t count,
+                     double tol, bool ulp);
+bool _mtest_near_all(void *self, const char *file, int line, bool assertion,
+                     const char *lhs, const char *rhs,
+                     const double *lbuf, const double *rbuf, size_t count,
+                     double tol, bool ulp);
+size_t _mtest_mem_mismatches(const void *lbuf, const void *rbuf, size_t count,
+                             size_t elem, size_t *first);
+void _mtest_fail_range(void *self, const char *file, int line, bool assertion,
+                       const char *lhs, const char *rhs, size_t lcount,
+                       size_t rcount, size_t mismatches, size_t first,
+                       _mtest_value lval, _mtest_value rval);
 
-// Define main if we are a test runner
-#ifdef MTEST_MAIN
-int main(int argc, char** argv) { return mtest_main(argc - 1, argv + 1); }
+struct _mtest_bytes
+{
+  const void *data;
+  size_t size;
+};
+
+_mtest_bytes _mtest_to_bytes(const char *str);
+
+template <typename S>
+inline auto _mtest_to_bytes(const S &s) -> decltype(s.data(), s.size(), _mtest_bytes())
+{
+  _mtest_bytes b = { s.data(), s.size() * sizeof(*s.data()) };
+  return b;
+}
+
+bool _mtest_golden(void *self, const char *file, int line, bool assertion,
+                   const char *expr, _mtest_bytes data, const char *path);
+
+template <typename C>
+inline auto _mtest_begin(const C &c) -> decltype(c.begin()) { return c.begin(); }
+template <typename C>
+inline auto _mtest_end(const C &c) -> decltype(c.end()) { return c.end(); }
+template <typename T, size_t N>
+inline const T *_mtest_begin(const T (&arr)[N]) { return arr; }
+template <typename T, size_t N>
+inline const T *_mtest_end(const T (&arr)[N]) { return arr + N; }
+
+// Element types which compare equal exactly when their bytes are equal
+template <typename T> struct _mtest_bytewise {};
+#define MT_BYTEWISE(T) template <> struct _mtest_bytewise<T> { typedef T type; };
+MT_BYTEWISE(char)
+MT_BYTEWISE(signed char)
+MT_BYTEWISE(unsigned char)
+MT_BYTEWISE(short)
+MT_BYTEWISE(unsigned short)
+MT_BYTEWISE(int)
+MT_BYTEWISE(unsigned int)
+MT_BYTEWISE(long)
+MT_BYTEWISE(unsigned long)
+MT_BYTEWISE(long long)
+MT_BYTEWISE(unsigned long long)
+
+template <typename T>
+typename _mtest_bytewise<T>::type _mtest_bytewise_check(const T *, const T *);
+
+// Contiguous ranges of integers are compared with the vectorized kernel
+template <typename A, typename B>
+inline auto _mtest_range_eq_impl(void *self, const char *file, int line,
+                                 bool assertion, const char *lhs, const char *rhs,
+                                 const A &a, const B &b, int)
+  -> decltype(_mtest_bytewise_check(a.data(), b.data()), bool())
+{
+  size_t n = a.size() < b.size() ? a.size() : b.size();
+  size_t first = 0;
+  size_t mismatches = _mtest_mem_mismatches(a.data(), b.data(), n,
+                                            sizeof(*a.data()), &first);
+
+  if (!mismatches && a.size() == b.size())
+    return true;
+
+  if (!mismatches)
+  {
+    _mtest_fail_range(self, file, line, assertion, lhs, rhs, a.size(), b.size(),
+                      0, 0, _mtest_val(0), _mtest_val(0));
+    return false;
+  }
+
+  _mtest_fail_range(self, file, line, assertion, lhs, rhs, a.size(), b.size(),
+                    mismatches, first, _mtest_val(a.data()[first]),
+                    _mtest_val(b.data()[first]));
+  return false;
+}
+
+template <typename A, typename B>
+inline bool _mtest_range_eq_impl(void *self, const char *file, int line,
+                                 bool assertion, const char *lhs, const char *rhs,
+                                 const A &a, const B &b, long)
+{
+  auto ia = _mtest_begin(a), ea = _mtest_end(a), fa = ia;
+  auto ib = _mtest_begin(b), eb = _mtest_end(b), fb = ib;
+  size_t i = 0, first = 0, mismatches = 0;
+
+  for (; ia != ea && ib != eb; ++ia, ++ib, ++i)
+    if (!(*ia == *ib) && !mismatches++)
+    {
+      first = i;
+      fa = ia;
+      fb = ib;
+    }
+
+  size_t lcount = i, rcount = i;
+
+  for (; ia != ea; ++ia) ++lcount;
+  for (; ib != eb; ++ib) ++rcount;
+
+  if (!mismatches && lcount == rcount)
+    return true;
+
+  // With no differing elements fa and fb may be past the end
+  if (!mismatches)
+  {
+    _mtest_fail_range(self, file, line, assertion, lhs, rhs, lcount, rcount,
+                      0, 0, _mtest_val(0), _mtest_val(0));
+    return false;
+  }
+
+  _mtest_fail_range(self, file, line, assertion, lhs, rhs, lcount, rcount,
+                    mismatches, first, _mtest_val(*fa), _mtest_val(*fb));
+  return false;
+}
+
+template <typename A, typename B>
+inline bool _mtest_range_eq(void *self, const char *file, int line,
+                            bool assertion, const char *lhs, const char *rhs,
+                            const A &a, const B &b)
+{
+  return _mtest_range_eq_impl(self, file, line, assertion, lhs, rhs, a, b, 0);
+}
+
+long long _mtest_trace_now();
+void _mtest_trace_span(const char *name, long long start);
+
+struct _mtest_trace_scope
+{
+  _mtest_trace_scope(const char *name) : name(name), start(_mtest_trace_now()) {}
+  ~_mtest_trace_scope() { _mtest_trace_span(name, start); }
+
+  const char *name;
+  long long start;
+};
+
+void _mtest_log_values(void *self, const _mtest_value *vals, size_t count);
+
+template <typename... Args>
+inline void _mtest_log(void *self, const Args &... args)
+{
+  _mtest_value vals[] = { _mtest_val(args)... };
+  _mtest_log_values(self, vals, sizeof...(Args));
+}
+
+void *_mtest_group_create();
+void _mtest_group_destroy(void *group);
+void _mtest_group_run(void *group, void (*fn)(void*), void *arg);
+void _mtest_group_wait(void *group);
+size_t _mtest_pool_chunks(size_t count);
+
+template <typename F>
+void _mtest_task_call(void *arg)
+{
+  F *fn = (F *)arg;
+  (*fn)();
+  delete fn;
+}
+
+/**
+ * Group of tasks run on the mtest worker pool. Tasks may be added from any
+ * thread, including from other tasks. wait() runs queued tasks on the
+ * calling thread until every task in the group has finished.
+ */
+class mtest_task_group
+{
+public:
+  mtest_task_group() : state(_mtest_group_create()) {}
+  ~mtest_task_group() { _mtest_group_destroy(state); }
+
+  /**
+   * Queues a copy of a callable taking no arguments.
+   *
+   * @param fn Callable to run.
+   */
+  template <typename F>
+  void run(const F &fn)
+  {
+    _mtest_group_run(state, &_mtest_task_call<F>, new F(fn));
+  }
+
+  /**
+   * Blocks until every task in the group has finished.
+   */
+  void wait() { _mtest_group_wait(state); }
+
+private:
+  mtest_task_group(const mtest_task_group &);
+  mtest_task_group &operator=(const mtest_task_group &);
+
+  void *state;
+};
+
+/**
+ * Calls body(i) for every i in [begin, end), splitting the range into tasks
+ * on the mtest worker pool. See MT_PARALLEL_FOR().
+ *
+ * @param begin First value.
+ * @param end   One past the last value.
+ * @param body  Callable taking the loop value.
+ */
+template <typename B, typename E, typename F>
+void mtest_parallel_for(B first, E last, const F &body)
+{
+  typedef decltype(first + last) I;
+  I begin = first, end = last;
+
+  if (!(begin < end))
+    return;
+
+  size_t count = (size_t)(end - begin);
+  size_t chunks = _mtest_pool_chunks(count);
+  mtest_task_group group;
+
+  for (size_t c = 0; c < chunks; ++c)
+  {
+    I lo = begin + (I)(count * c / chunks);
+    I hi = begin + (I)(count * (c + 1) / chunks);
+
+    group.run([lo, hi, &body]() {
+      for (I i = lo; i < hi; ++i)
+        body(i);
+    });
+  }
+
+  group.wait();
+}
+
+// Asynchronous tests require C++20 coroutines and epoll
+#if defined(__linux__) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+#define MTEST_ASYNC
+
+int _mtest_push_async(const char* name, void(*tstart)(void*));
+void _mtest_async_done(void *self);
+void _mtest_async_sleep(void(*resume)(void*), void(*destroy)(void*), void *handle, int ms);
+void _mtest_async_wait_fd(void(*resume)(void*), void(*destroy)(void*), void *handle,
+                          int fd, bool write);
+
+inline void _mtest_resume(void *handle)
+{
+  std::coroutine_handle<>::from_address(handle).resume();
+}
+
+inline void _mtest_destroy(void *handle)
+{
+  std::coroutine_handle<>::from_address(handle).destroy();
+}
+
+/**
+ * Return type of asynchronous test bodies. Tests start on the mtest event
+ * loop and report their result once the coroutine completes.
+ */
+struct mtest_async
+{
+  struct promise_type
+  {
+    promise_type(void *self) : self(self) {}
+
+    mtest_async get_return_object() { return mtest_async(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept
+    {
+      _mtest_async_done(self);
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { throw; }
+
+    void *self;
+  };
+};
+
+/**
+ * Suspends an asynchronous test for at least `ms` milliseconds.
+ *
+ * co_await mtest_sleep(100);
+ */
+struct mtest_sleep
+{
+  mtest_sleep(int ms) : ms(ms) {}
+
+  bool await_ready() const noexcept { return ms <= 0; }
+  void await_suspend(std::coroutine_handle<> h)
+  {
+    _mtest_async_sleep(&_mtest_resume, &_mtest_destroy, h.address(), ms);
+  }
+  void await_resume() const noexcept {}
+
+  int ms;
+};
+
+/**
+ * Suspends an asynchronous test until a file descriptor is readable
+ * (or writable, for mtest_writable).
+ *
+ * co_await mtest_readable(sock);
+ */
+struct mtest_readable
+{
+  mtest_readable(int fd, bool write = false) : fd(fd), write(write) {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h)
+  {
+    _mtest_async_wait_fd(&_mtest_resume, &_mtest_destroy, h.address(), fd, write);
+  }
+  void await_resume() const noexcept {}
+
+  int fd;
+  bool write;
+};
+
+struct mtest_writable : mtest_readable
+{
+  mtest_writable(int fd) : mtest_readable(fd, true) {}
+};
+
+/**
+ * Defines an asynchronous test. The body is a coroutine which runs on the
+ * mtest event loop, so any number of tests waiting on timers or file
+ * descriptors share a single thread. Use co_await with mtest_sleep,
+ * mtest_readable or mtest_writable to wait, and co_return to abort the test.
+ * ASSERT() is not available inside asynchronous tests.
+ *
+ * TEST_ASYNC(MyTestName) {
+ *   co_await mtest_sleep(10);
+ *   EXPECT(...);
+ * }
+ *
+ * @param name Test name token.
+ */
+#define TEST_ASYNC(name)                                                       \
+  static mtest_async _test_##name(void *s);                                    \
+  static void _test_start_##name(void *s) { _test_##name(s); }                 \
+  static int _test_add_##name = _mtest_push_async(#name, &_test_start_##name); \
+  mtest_async _test_##name(void *__self)
 #endif
 
 #endif
+
+// Define main if we are a test runner, outside the include guard so that a
+// precompiled mtest.h included ahead of MTEST_MAIN doesn't hide it
+#if defined(MTEST_MAIN) && !defined(MTEST_MAIN_DEFINED)
+#define MTEST_MAIN_DEFINED
+int main(int argc, char** argv) { return mtest_main(argc - 1, argv + 1); }
+#endif